@@ -13,11 +13,24 @@
 #include <time.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <glob.h>
+#include <limits.h>
 #include <sys/times.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
 
+#include "capture.h"
 #include "com.h"
+#include "device.h"
+#include "image.h"
+#include "wire.h"
+#include "report.h"
+#include "profile.h"
+#include "progress.h"
 #include "protocol.h"
+#include "trigger.h"
 
 
 /**************************************************************/
@@ -27,6 +40,9 @@
 #define AVR_VERIFY      0x02
 #define AVR_TERMINAL    0x04
 #define AVR_CLEAN       0x08
+#define AVR_COMPILE     0x10
+#define AVR_IF_CHANGED  0x20
+#define AVR_TUNE        0x40
 
 #define AUX     1
 #define CON     2
@@ -42,10 +58,55 @@
 #define CTRLE   0x05
 #define CTRLF   0x06
 #define CTRLV   0x16
+#define CTRLU   0x15
 
 // Definitions
 #define TIMEOUT   3   // 0.3s
 #define TIMEOUTP  40  // 4s
+// wait for BADCOMMAND after VERIFY when comparing first: a round trip
+// through the latency timer of an adaptor, plus the byte times
+#define VERIFY_POLL_MS  40
+
+// terminal mode: receive buffer (about 50ms of the line) and runs per writev
+#define TERM_BUF_MIN    1024
+#define TERM_BUF_MAX    65536
+#define TERM_IOV        64
+
+// sending a file in terminal mode: chunk between looking at the input,
+// output queue it may fill
+#define SEND_CHUNK      256
+#define SEND_QUEUE      1024
+#define SEND_ROOM       -1      // send_wait: until the queue has room
+
+// results of prog_verify, exit code of the gang workers (negated)
+#define PV_UNCHANGED     1     // success, the device had the image already
+#define PV_OK            0
+#define PV_NO_IMAGE     -1
+#define PV_NO_FIT       -2
+#define PV_NO_INFO      -3
+#define PV_NO_CONNECT   -4
+#define PV_PROG_FAIL    -5
+#define PV_CRC_FAIL     -6
+#define PV_VERIFY_FAIL  -7
+#define PV_NO_PORT      -8
+
+// maximum number of baudrates in a ladder
+#define MAX_BAUDS       16
+// maximum length of 0x0d, password and 0xff
+#define CONNECT_BURST   64
+
+// scratch image and passes of --autotune: the image takes about
+// TUNE_WIRE_MS on the wire, far more than the latency of an adaptor
+#define TUNE_SIZE       1024
+#define TUNE_WIRE_MS    250
+#define TUNE_PASSES     3
+// run to run spread below which settings count as equal
+#define TUNE_SPREAD     2       // percent
+// the sweep is cut off after this time
+#define TUNE_MAX_S      60
+
+// seconds to wait for a connect before stepping down the ladder
+#define LADDER_TIMEOUT  2
 
 
 #define ELAPSED_TIME(a) {                   \
@@ -75,6 +136,49 @@ static autoreset_t autoreset = AUTORESET;
 
 static int              bsize = 16;
 
+// progress bar and animation, off when the output is collected
+
+// a failing VERIFY only tells that the image differs
+static int              comparing = FALSE;
+
+// measuring transfers, no output
+static int              tuning = FALSE;
+// time of the last VERIFY data stream up to the answer, without the handshake
+static unsigned long long stream_us = 0;
+
+// use the transfer settings of the adaptor found by --autotune
+static int              use_profile = TRUE;
+
+// delay in msec between the resets of the devices in gang mode
+static int              stagger = 100;
+
+// print the CONTINUE latencies of the buffers
+static int              show_latency = FALSE;
+
+// send the queries of read_info in one burst
+static int              pipeline = FALSE;
+
+// file sent in terminal mode (--send, CTRL U), delay after each line in msec,
+// the device may stop the stream with XOFF
+static const char       *sendfile = NULL;
+static int              line_delay = 0;
+static int              xonxoff = FALSE;
+
+// capture of the terminal mode: file, chunks with headers, rotate after n bytes
+static const char       *capturefile = NULL;
+static int              capture_raw = FALSE;
+static unsigned long long capture_rotate = 0;
+
+// JSON file for the timing report
+static const char       *reportfile = NULL;
+
+// give up connecting after n seconds, 0: wait forever
+static int              connect_timeout = 0;
+
+// DTR reset: pulse width and period of the retries in msec
+static int              reset_pulse = 10;
+static int              retry_period = 400;
+
     // pointer to password...
     // following characters are needed for autobaud
     // 0x0A - LF,  0x0B - VT,  0x0D - CR,  0x0F - SI
@@ -84,6 +188,20 @@ static char             *password = "Peda";
 static char             *device = "/dev/ttyS0";
 static int              baud = 9600;
 
+// baudrates to try, fastest first (-b auto or a list)
+static const char       *baudspec = "9600";
+static unsigned long    bauds[MAX_BAUDS];
+static int              nbauds = 0;
+static int              ladder_rest = 0;    // slower rates left to try
+
+// ladder of -b auto
+static const unsigned long auto_bauds[] = {
+#ifdef __linux__
+    1000000, 500000, 250000,
+#endif
+    230400, 115200, 57600, 38400, 19200, 9600
+};
+
 /* variables for stopwatch */
 static clock_t  start  = 0;
 static double   ticks = 1;
@@ -91,6 +209,9 @@ static double   ticks = 1;
 // Filename of the HEX File
 static const char * hexfile = NULL;
 
+// load address of raw binary files
+static unsigned long binbase = 0;
+
 
 typedef struct bootInfo
 {
@@ -100,105 +221,18 @@ typedef struct bootInfo
     long    flashsize;
     int     crc_on;
     int     blocksize;
+    const device_t *device;     // entry of the device table, NULL if unknown
 } bootInfo_t;
 
 
-typedef struct
+// image to program / verify
+typedef struct flashImage
 {
-    unsigned long   id;
-    const char      *name;
-} avrdev_t;
-avrdev_t avr_dev[] = {
-    { 0x01e9005, "ATtiny12" },
-    { 0x01e9007, "ATtiny13" },
-    { 0x01e9006, "ATtiny15" },
-    { 0x01e9001, "AT90S1200" },
-    { 0x01e9201, "AT90S4414" },
-    { 0x01e9101, "AT90S2313" },
-    { 0x01e9105, "AT90S2333" },
-    { 0x01e9103, "AT90S2343" },
-    { 0x01e9203, "AT90S4433" },
-    { 0x01e9202, "AT90S4434" },
-    { 0x01e9301, "AT90S8515" },
-    { 0x01e9303, "AT90S8535" },
-    { 0x01e9701, "ATmega103" },
-    { 0x01e9602, "ATmega64" },
-    { 0x01e9702, "ATmega128" },
-    { 0x01e9781, "AT90CAN128" },
-    { 0x01e9681, "AT90CAN64" },
-    { 0x01e9581, "AT90CAN32" },
-    { 0x01e9403, "ATmega16" },
-    { 0x01e940a, "ATmega164P" },
-    { 0x01e9508, "ATmega324P" },
-    { 0x01e9511, "ATmega324PA" },
-    { 0x01e9609, "ATmega644" },
-    { 0x01e960a, "ATmega644P" },
-    { 0x01e9705, "ATmega1284P" },
-    { 0x01e9404, "ATmega162" },
-    { 0x01e9402, "ATmega163" },
-    { 0x01e9405, "ATmega169" },
-    { 0x01e9503, "ATmega329" },
-    { 0x01e950b, "ATmega329P" },
-    { 0x01e9504, "ATmega3290" },
-    { 0x01e950c, "ATmega3290P" },
-    { 0x01e9603, "ATmega649" },
-    { 0x01e9604, "ATmega6490" },
-    { 0x01e9502, "ATmega32" },
-    { 0x01e9401, "ATmega161" },
-    { 0x01e9307, "ATmega8" },
-    { 0x01e9306, "ATmega8515" },
-    { 0x01e9308, "ATmega8535" },
-    { 0x01e9109, "ATtiny26" },
-    { 0x01e910c, "ATtiny261" },
-    { 0x01e9208, "ATtiny461" },
-    { 0x01e930d, "ATtiny861" },
-    { 0x01e9205, "ATmega48" },
-    { 0x01e930a, "ATmega88" },
-    { 0x01e930f, "ATmega88P" },
-    { 0x01e9406, "ATmega168" },
-    { 0x01e940b, "ATmega168P" },
-    { 0x01e9311, "ATtiny88" },
-    { 0x01e9514, "ATmega328" },
-    { 0x01e950F, "ATmega328P" },
-    { 0x01e910a, "ATtiny2313" },
-    { 0x01e920d, "ATtiny4313" },
-    { 0x01e9381, "AT90PWM2" },
-    { 0x01e9381, "AT90PWM3" },
-    { 0x01e9383, "AT90PWM2B" },
-    { 0x01e9383, "AT90PWM3B" },
-    { 0x01e9108, "ATtiny25" },
-    { 0x01e9206, "ATtiny45" },
-    { 0x01e930b, "ATtiny85" },
-    { 0x01e9608, "ATmega640" },
-    { 0x01e9703, "ATmega1280" },
-    { 0x01e9704, "ATmega1281" },
-    { 0x01e9801, "ATmega2560" },
-    { 0x01e9802, "ATmega2561" },
-    { 0x01ea701, "ATmega128RFA1" },
-    { 0x01e910b, "ATtiny24" },
-    { 0x01e9207, "ATtiny44" },
-    { 0x01e930c, "ATtiny84" },
-    { 0x01e9587, "ATmega32U4" },
-    { 0x01e9682, "AT90USB646" },
-    { 0x01e9682, "AT90USB647" },
-    { 0x01e9782, "AT90USB1286" },
-    { 0x01e9782, "AT90USB1287" },
-    { 0x01e9482, "AT90USB162" },
-    { 0x01e9382, "AT90USB82" },
-    { 0x01e958a, "ATmega32U2" },
-    { 0x01e9489, "ATmega16U2" },
-    { 0x01e9389, "ATmega8U2" },
-    { 0x01e9505, "ATmega325" },
-    { 0x01E9605, "ATmega645" },
-    { 0x01E9506, "ATmega3250" },
-    { 0x01E9606, "ATmega6450" },
-    { 0x0EDC03F, "32UC3A0512" },
-    { 0x01e8f0a, "ATtiny4" },
-    { 0x01e8f09, "ATtiny5" },
-    { 0x01e9008, "ATtiny9" },
-    { 0x01e9003, "ATtiny10" }
-};
-
+    char            *data;          // flash buffer
+    unsigned long   lastaddr;       // last address in hexfile
+    int             use_bundle;     // precompiled bundle instead of data
+    wire_t          bundle;
+} flashImage_t;
 
 
 /*****************************************************************************
@@ -245,368 +279,161 @@ static int set_tty_timeout (int    fd,
     return (old_timeout);
 }
 
-
-/**
- * reads hex data from string
- */
-int sscanhex (char          *str,
-              unsigned int  *hexout,
-              int           n)
+/*****************************************************************************
+ *
+ *      Switch XON/XOFF flow control of the output, returns old state
+ *
+ ****************************************************************************/
+static int set_tty_xonxoff (int    fd,
+                            int    on)
 {
-    unsigned int hex = 0, x = 0;
-
-    for(; n; n--)
-    {
-        x = *str;
-        if(x >= 'a')
-        {
-            x += 10 - 'a';
-        }
-        else if(x >= 'A')
-        {
-            x += 10 - 'A';
-        }
-        else
-        {
-            x -= '0';
-        }
+    struct termios      terminal;
+    int                 old;
 
-        if(x >= 16)
-        {
-            break;
-        }
+    tcgetattr (fd, &terminal);
+    old = (terminal.c_iflag & IXON) != 0;
 
-        hex = hex * 16 + x;
-        str++;
-    }
+    if (on)
+        terminal.c_iflag |= IXON;
+    else
+        terminal.c_iflag &= ~IXON;
+    tcsetattr (fd, TCSANOW, &terminal);
 
-    *hexout = hex;
-    return n; // 0 if all digits
+    return (old);
 }
 
 
 /**
- * Reads the hex file
+ * Sends the end marker of PROGRAM / VERIFY data and waits for the answer
  *
- * @return 1 to 255 number of bytes, -1 file end, -2 error or no HEX File
- */
-int readhex (FILE           *fp,
-             unsigned long  *addr,
-             unsigned char  *data)
-{
-    char hexline[524]; // intel hex: max 255 byte
-    char *hp = hexline;
-    unsigned int byte;
-    int i;
-    unsigned int num;
-    unsigned int low_addr;
-
-    if(fgets( hexline, 524, fp ) == NULL)
-    {
-        return -1; // end of file
-    }
-
-    if(*hp++ != ':')
-    {
-        return -2; // no hex record
-    }
-
-    if(sscanhex(hp, &num, 2))
-    {
-        return -2; // no hex number
-    }
-
-    hp += 2;
-
-    if(sscanhex(hp, &low_addr, 4))
-    {
-        return -2;
-    }
-
-    *addr &= 0xF0000L;
-    *addr += low_addr;
-    hp += 4;
-
-    if(sscanhex( hp, &byte, 2))
-    {
-        return -2;
-    }
-
-    if(byte == 2)
-    {
-        hp += 2;
-        if(sscanhex(hp, &low_addr, 4))
-        {
-            return -2;
-        }
-        *addr = low_addr * 16L;
-        return 0; // segment record
-    }
-
-    if(byte == 1)
-    {
-        return 0; // end record
-    }
-
-    if(byte != 0)
-    {
-        return -2; // error, unknown record
-    }
-
-    for(i = num; i--;)
-    {
-        hp += 2;
-        if(sscanhex(hp, &byte, 2))
-        {
-            return -2;
-        }
-        *data++ = byte;
-    }
-    return num;
-}
-
-/**
- * Read a hexfile
+ * @return 0 on success, 3 on fail
  */
-char * read_hexfile(const char * filename, unsigned long * lastaddr)
+static int end_transfer (int fd)
 {
-    char    *data;
-    FILE    *fp;
-    int     len;
-    int     x;
-    unsigned char line[256];
-    unsigned long addr = 0;
-
-    data = malloc(MAXFLASH);
-    if (data == NULL)
-    {
-        printf("Memory allocation error, could not get %d bytes for flash-buffer!\n",
-               MAXFLASH);
-        return NULL;
-    }
-
-    *lastaddr = 0;
-    memset (data, 0xff, MAXFLASH);
-
-    if(NULL == (fp = fopen(filename, "r")))
-    {
-        printf("File \"%s\" open failed: %s!\n\n", filename, strerror(errno));
-        free(data);
-        return NULL;
-    }
-
-    printf("Reading       : %s... ", filename);
+    com_putc_fast(fd, ESCAPE);
+    com_putc_fast(fd, ESC_SHIFT); // A5,80 = End
+    com_drain(fd);
 
-
-    // reading file to "data"
-    while((len = readhex(fp, &addr, line)) >= 0)
+    switch (com_getc (fd, TIMEOUTP))
     {
-        if(len)
-        {
-            if( addr + len > MAXFLASH )
-            {
-                fclose(fp);
-                free(data);
-                printf("\n  Hex-file too large for target!\n");
-                return NULL;
-            }
-            for(x = 0; x < len; x++)
-            {
-                data[x + addr] = line[x];
-            }
-
-            addr += len;
-
-            if(*lastaddr < (addr-1))
-            {
-                *lastaddr = addr-1;
-            }
-            addr++;
-        }
+        case SUCCESS:
+            // o.k.
+            break;
+        case FAIL:
+            // only a difference when comparing
+            if (!comparing)
+                printf("\n ---------- Failed! ----------\n");
+            return 3;
+        case BADCOMMAND:
+            // late answer to VERIFY, the stream has been ignored
+            // (see verify_refused); the device answered every A5 in it
+            printf("\nVerify not available\n");
+            while (com_getc (fd, TIMEOUT) >= 0);
+            return 4;
+        case COM_DISCONNECT:
+            printf("\n ---- Device disconnected ----");
+            // FALLTHROUGH
+        default:
+        printf("\n ---------- Failed! ----------\n");
+        return 3;
     }
-
-    fclose(fp);
-
-    printf("File read.\n");
-    return data;
+    return 0;
 }
 
 
 /**
- * Reads a value from bootloader
+ * Waits for BADCOMMAND after VERIFY has been sent. When comparing
+ * first, it is only waited for a round trip, the full TIMEOUT would
+ * take longer than the stream of a small image; a later BADCOMMAND is
+ * taken by end_transfer instead. One-wire reads its echo while sending,
+ * so it waits the full time.
  *
- * @return value; -2 on error; exit on timeout
- */
-long readval(int fd)
-{
-    int i;
-    int j = 257;
-    long val = 0;
-
-    while(1)
-    {
-        i = com_getc (fd, TIMEOUT);
-        if (i == COM_TIMEOUT)
-        {
-            printf("readval: ...Device does not answer!\n");
-            return -3;
-        }
-        else if (i == COM_DISCONNECT)
-        {
-            printf("readval: ...Device disconnected!\n");
-            return -4;
-        }
-
-        switch(j)
-        {
-            case 1:
-                if(i == SUCCESS)
-                {
-                    return val;
-                }
-                break;
-
-            case 2:
-            case 3:
-            case 4:
-                val = val * 256 + i;
-                j--;
-                break;
-
-            case 256:
-                j = i;
-                break;
-
-            case 257:
-                if(i == FAIL) {
-                    return -2;
-                }
-                else if(i == ANSWER) {
-                    j = 256;
-                }
-                break;
-
-            default:
-                printf("\nError: readval, i = %i, j = %i, val = %li\n", i, j, val);
-                return -2;
-        }
-    }
-    return -1;
-}
-
-/**
- * Print percentage line
+ * @return TRUE if the device can't verify
  */
-void print_perc_bar (char          *text,
-                     unsigned long full_val,
-                     unsigned long cur_val)
+static int verify_refused (int fd)
 {
-    int         i;
-    int         cur_perc;
-    int         cur100p;
-    int         txtlen = 8;    // length of the add. text 2 * " [" "100%"
-    unsigned short columns = 80;
-    struct winsize win_size;
-
-    if (full_val == 0)
-        return;
-
-    if (text)
-        txtlen += strlen (text);
-
-    if (ioctl (STDIN_FILENO, TIOCGWINSZ, &win_size) >= 0)
-    {
-        // number of columns in terminal
-        columns = win_size.ws_col;
-    }
-    cur100p  = columns - txtlen;
-
-    cur_perc = (cur_val * cur100p) / full_val;
+    int ms = TIMEOUT * 100;
 
-    printf ("%s [", text ? text : "");
+    if (comparing && !com_is_localecho ())
+        ms = VERIFY_POLL_MS + 30000 / baud;
 
-    for (i = 0; i < cur_perc; i++) printf ("#");
-    for (     ; i < cur100p;  i++) printf (" ");
+    if (com_getc_ms (fd, ms) != BADCOMMAND)
+        return FALSE;
 
-    printf ("] %3d%%\r", (int)((cur_val * 100) / full_val));
-
-    fflush(stdout);
+    printf("Verify not available\n");
+    return TRUE;
 }
 
 
 /**
  * Verify the controller
+ *
+ * @return 0 on success, 3 on fail, 4 if the device can't verify
  */
 int verifyflash (int           fd,
                  char        * data,
                  unsigned long lastaddr,
                  bootInfo_t  * bInfo)
 {
-    struct tms  timestruct;
-    clock_t     start_time;       //time
-    clock_t     end_time;         //time
-    float       seconds;
+    unsigned long long  start_time = get_time_us ();
+    double              seconds;
 
-    unsigned char d1;
+    unsigned char buf[2 * WIRE_CHUNK];
     unsigned long addr = 0;
-
-    start_time = times (&timestruct);
+    unsigned long escapes = 0;
+    unsigned long n;
+    size_t        len;
+    int           ret;
 
     // Sending commands to MC
     sendcommand(fd, VERIFY);
 
-    if(com_getc(fd, TIMEOUT) == BADCOMMAND)
-    {
-        printf("Verify not available\n");
-        return 0;
-    }
-    printf( "Verify        : 0x00000 - 0x%05lX\n", lastaddr);
+    if (verify_refused (fd))
+        return 4;
+    if (!tuning)
+        printf( "Verify        : 0x00000 - 0x%05lX\n", lastaddr);
+
+    // the stream only, the wait for BADCOMMAND above is fixed
+    stream_us = get_time_us ();
 
-    do
+    progress_start ("Verifying", lastaddr);
+    while (addr <= lastaddr)
     {
-        if ((addr % 16) == 0)
-            print_perc_bar ("Verifying", lastaddr, addr);
+        n = lastaddr + 1 - addr;
+        if (n > WIRE_CHUNK)
+            n = WIRE_CHUNK;
 
-        d1 = data[addr];
+        len = wire_escape ((const unsigned char *)data + addr, n, buf);
+        escapes += len - n;
 
-        if ((d1 == ESCAPE) || (d1 == 0x13))
+        // keep the output queue filled
+        com_pace (fd);
+        if (com_write (fd, buf, len) < 0)
         {
-            com_putc(fd, ESCAPE);
-            d1 += ESC_SHIFT;
+            progress_done (FALSE);
+            printf("\n ---- Device disconnected ----");
+            printf("\n ---------- Failed! ----------\n");
+            return 3;
         }
-        if (addr % bInfo->blocksize)
-            com_putc_fast (fd, d1);
-        else
-            com_putc (fd, d1);
-
-    } while (addr++ < lastaddr);
+        addr += n;
+        progress_update (addr);
+    }
 
+    progress_done (TRUE);
 
-    print_perc_bar ("Verifying", 100, 100);
+    seconds = (get_time_us () - start_time) / 1000000.0;
 
-    end_time = times (&timestruct);
-    seconds  = (float)(end_time-start_time)/sysconf(_SC_CLK_TCK);
+    if (!tuning)
+        printf("\nElapsed time  : %3.2f seconds, %.0f Bytes/sec.\n",
+               seconds,
+               (lastaddr + 1) / seconds);
 
-    printf("\nElapsed time  : %3.2f seconds, %.0f Bytes/sec.\n",
-           seconds,
-           (float)lastaddr / seconds);
+    report_data (lastaddr + 1, escapes, 0);
 
-    com_putc(fd, ESCAPE);
-    com_putc(fd, ESC_SHIFT); // A5,80 = End
+    ret = end_transfer(fd);
+    stream_us = get_time_us () - stream_us;
 
-    switch (com_getc (fd, TIMEOUTP))
-    {
-        case SUCCESS:
-            // o.k.
-            break;
-        case COM_DISCONNECT:
-            printf("\n ---- Device disconnected ----");
-            // FALLTHROUGH
-        default:
-        printf("\n ---------- Failed! ----------\n");
-        return 3;
-    }
-    return 0;
+    return ret;
 }
 
 
@@ -618,16 +445,24 @@ int programflash (int           fd,
                   unsigned long lastaddr,
                   bootInfo_t *  bInfo)
 {
-    struct tms  timestruct;
-    clock_t start_time;       //time
-    clock_t end_time;         //time
-    float   seconds;
+    unsigned long long  start_time = get_time_us ();
+    double              seconds;
 
+    unsigned char buf[2 * WIRE_CHUNK];
     unsigned long i;
-    unsigned char d1;
     unsigned long addr = 0;
+    unsigned long escapes = 0;
+    unsigned long blocks = 0;
+    unsigned long n;
+    size_t        len;
+    unsigned int  known_crc;
+    int           ret;
+
+    // after a CHECK_CRC the CRC of the transfer is the one of the cache
+    int use_known = (crc == 0) && (image_program_crc (data, lastaddr, &known_crc) == 0);
 
-    start_time = times (&timestruct);
+    if (use_known)
+        com_crc_calc (FALSE);
 
     // Sending commands to MC
     printf("Programming   : 0x00000 - 0x%05lX\n", lastaddr);
@@ -636,68 +471,85 @@ int programflash (int           fd,
     // Sending data to MC
     i = bInfo->buffsize;
 
-    do
+    progress_start ("Writing", lastaddr);
+    while (addr <= lastaddr)
     {
-        if ((addr % 16) == 0)
-            print_perc_bar ("Writing", lastaddr, addr);
-
-        d1 = data[addr];
-
-        if ((d1 == ESCAPE) || (d1 == 0x13))
+        // a chunk never runs past the end of the target buffer
+        n = lastaddr + 1 - addr;
+        if (n > WIRE_CHUNK)
+            n = WIRE_CHUNK;
+        if (n > i)
+            n = i;
+
+        len = wire_escape ((const unsigned char *)data + addr, n, buf);
+        escapes += len - n;
+
+        // keep the output queue filled
+        com_pace (fd);
+        if (com_write (fd, buf, len) < 0)
         {
-            com_putc(fd, ESCAPE);
-            d1 += ESC_SHIFT;
+            progress_done (FALSE);
+            printf("\n ---- Device disconnected ----");
+            printf("\n ---------- Failed! ----------\n");
+            com_crc_calc (TRUE);
+            return 2;
         }
-        if (i % bInfo->blocksize)
-            com_putc_fast (fd, d1);
-        else
-            com_putc (fd, d1);
+        addr += n;
+        progress_update (addr);
 
-        if (--i == 0)
+        i -= n;
+        if (i == 0)
         {
+            unsigned long long sent;
+
+            // buffer of the target is full, it answers when written
+            com_drain (fd);
+            sent = get_time_us ();
+
             switch (com_getc (fd, TIMEOUTP))
             {
                 case CONTINUE:
                     // o.k.
+                    report_latency (addr - bInfo->buffsize,
+                                    get_time_us () - sent);
                     break;
                 case COM_DISCONNECT:
+                    progress_done (FALSE);
                     printf("\n ---- Device disconnected ----");
                     // FALLTHROUGH
                 default:
+                    progress_done (FALSE);
                     printf("\n ---------- Failed! ----------\n");
+                    com_crc_calc (TRUE);
                     return 2;
             }
 
             // set nr of bytes with next block
             i = bInfo->buffsize;
+            blocks++;
         }
-    } while (addr++ < lastaddr);
+    }
 
-    print_perc_bar ("Writing", 100, 100);
+    progress_done (TRUE);
 
-    end_time = times (&timestruct);
-    seconds  = (float)(end_time-start_time)/sysconf(_SC_CLK_TCK);
+    seconds = (get_time_us () - start_time) / 1000000.0;
 
     printf("\nElapsed time  : %3.2f seconds, %.0f Bytes/sec.\n",
            seconds,
-           (float)lastaddr / seconds);
+           (lastaddr + 1) / seconds);
 
-    com_putc(fd, ESCAPE);
-    com_putc(fd, ESC_SHIFT); // A5,80 = End
+    report_data (lastaddr + 1, escapes, blocks);
 
-    switch (com_getc (fd, TIMEOUTP))
+    ret = end_transfer(fd);
+
+    // the whole stream has been sent
+    if (use_known)
     {
-        case SUCCESS:
-            // o.k.
-            break;
-        case COM_DISCONNECT:
-            printf("\n ---- Device disconnected ----");
-            // FALLTHROUGH
-        default:
-        printf("\n ---------- Failed! ----------\n");
-        return 3;
+        com_crc_calc (TRUE);
+        crc = known_crc;
     }
-    return 0;
+
+    return ret;
 }
 
 
@@ -707,20 +559,65 @@ int programflash (int           fd,
  */
 void usage(char *name)
 {
-    printf("%s [-d /dev/ttyS0] [-b 9600] -[v|p] file.hex\n"
+    printf("%s [-d /dev/ttyS0] [-b 9600] -[v|p] file.hex|file.bin|file.elf\n"
            "-d /dev/ttynn   Device (use e.g. /dev/serial/by-id/usb-FTDI* for FT232)\n"
-           "-b nn           Baudrate\n"
+           "                several devices (separated by ',' or a quoted wildcard)\n"
+           "                are programmed in parallel\n"
+           "--stagger ms    delay between the resets of several devices, default 100\n"
+           "--report file   write the timing of every phase as JSON to file\n"
+           "                (with several devices one file per device)\n"
+           "--latency       show the time the device needs to write each buffer\n"
+           "--slow ms       ...and list the buffers slower than ms\n"
+           "--timeout s     stop waiting for a device after s seconds\n"
+           "                (default: wait forever, 10 with several devices)\n"
+           "-b nn           Baudrate; a list (230400,115200,...) or auto tries\n"
+           "                the fastest first and steps down if the device does\n"
+           "                not connect or the CRC check fails\n"
            "-t nn           TxD Blocksize (i.e. number of bytes written in one block)\n"
            "-w nn           do not use tcdrain, wait nn times byte transmission time instead\n"
+           "-D              drain after every TxD block instead of streaming them\n"
+           "--autotune      measure the best -t / -D / -w with VERIFY passes (the\n"
+           "                flash is not written) and store them for the adaptor;\n"
+           "                they are used later unless -t, -D, -w or --no-profile\n"
+           "                are given\n"
+           "--pipeline      send the queries after connecting in one burst; the\n"
+           "                device has to receive while it answers\n"
            "-r              switch reset off, DTR will not be changed\n"
-           "-R (default)    toggle DTR to reset device: DTR will toggle\n"
-           "                during sending of password until connection is established\n"
+           "-R (default)    pulse DTR to reset device, repeated until\n"
+           "                connection is established\n"
+           "--reset-pulse ms  width of the DTR pulse, default 10\n"
+           "--retry ms      period of the reset pulses, default 400\n"
            "-v              Verify\n"
            "-p              Program\n"
+           "--if-changed    with -p: verify first, program only if the image differs\n"
            "-e              Erase, use together with -p to erase controller,\n"
            "                with -v to check if it is erased\n"
            "-P pwd          Password\n"
            "-T              enter terminal mode\n"
+           "--on pattern action\n"
+           "                with -T: when pattern is received program[=file],\n"
+           "                verify[=file], send=text, reset or mark[=text]\n"
+           "--send file     with -T: send file at line rate (again with CTRL U)\n"
+           "--line-delay ms ...waiting ms after each line\n"
+           "--xonxoff       ...stopping while the device sends XOFF\n"
+           "--capture file  with -T: write the received data with time stamps to file\n"
+           "--capture-raw   ...in chunks with a header instead of stamped lines\n"
+           "--capture-rotate MB\n"
+           "                ...renaming the file to file.1, .2, ... after MB\n"
+           "--base addr     load address of a raw binary file (*.bin), default 0\n"
+           "--no-cache      don't use the cache of decoded images ($XDG_CACHE_HOME/fboot)\n"
+           "--devices file  add or replace entries of the device table\n"
+           "                (default: $XDG_CONFIG_HOME/fboot/devices.txt)\n"
+           "--compile file.hex -o file.fbw\n"
+           "                write a precompiled bundle (.fbw) of file.hex, which can\n"
+           "                be used instead of the hexfile with -p and -v\n"
+           "--signature hex --buffsize nn\n"
+           "                target of the bundle, otherwise the device is asked\n"
+           "--selftest      check the CRC calculation and exit\n"
+           "exit code       0 success, 1 options or file, 2 does not fit,\n"
+           "                3 device info, 4 no connection, 5 programming,\n"
+           "                6 CRC, 7 verification, 8 port; with several\n"
+           "                devices the number of devices that failed\n"
            "Author: Bernhard Michler (based on code from Andreas Butti)\n", name);
 
     exit(1);
@@ -729,76 +626,138 @@ void usage(char *name)
 
 /**
  * Try to connect a device
+ *
+ * Runs on a monotonic timeline: every retry period DTR is pulsed to
+ * reset the device, meanwhile the autobaud character, the password and
+ * 0xff are streamed back to back at line rate, so the bootloader finds
+ * them as soon as it starts. The answer is read between the bursts,
+ * the spinner only follows the clock.
  */
 int connect_device ( int fd,
                      const char *password )
 {
     const char * ANIM_CHARS = "-\\|/";
 
-    int state = 0;
-    int val = 0;
-
-    char passtring[32];
+    unsigned char       burst[CONNECT_BURST];
+    size_t              len;
+    unsigned long long  now;
+    unsigned long long  start_time;
+    unsigned long long  next_reset;
+    unsigned long long  release = 0;
+    unsigned long long  next_anim;
+    unsigned long       burst_ms;
+    int                 state = 0;
+    int                 val = 0;
 
     // first 0x0d for autobaud, then password, then 0xff
     // for answer in one-line mode
-    sprintf (passtring, "%c%s%c", 0x0d, password, 0xff);
+    len = snprintf ((char *)burst, sizeof (burst), "%c%s%c", 0x0d, password, 0xff);
+    if (len >= sizeof (burst))
+    {
+        printf ("Password too long!\n");
+        return 0;
+    }
+
+    // the answer is read while the next burst is on the line
+    burst_ms = (len * 10000UL) / baud + 1;
+
+    start_time = get_time_us ();
+    next_anim  = start_time;
+    next_reset = start_time;
+
+    // start released, the pulse needs an edge
+    if (autoreset == AUTORESET)
+    {
+        com_set_dtr (fd, FALSE);
+        next_reset += reset_pulse * 1000ULL;
+    }
 
     printf("Waiting for device...  ");
 
     while (running)
     {
-        const char *s = passtring; //password;
+        now = get_time_us ();
+
+        if (connect_timeout &&
+            (now - start_time > connect_timeout * 1000000ULL))
+        {
+            printf ("\nNo device found (timeout).\n");
+            return 0;
+        }
 
         if (autoreset == AUTORESET)
         {
-            if ((state & 0x0f) == 0x00)
-                com_toggle_dtr (fd);
+            if (release && (now >= release))
+            {
+                com_set_dtr (fd, FALSE);
+                release = 0;
+            }
+            if (now >= next_reset)
+            {
+                com_set_dtr (fd, TRUE);
+                release     = now + reset_pulse * 1000ULL;
+                next_reset += retry_period * 1000ULL;
+                if (next_reset < now)
+                    next_reset = now + retry_period * 1000ULL;
+            }
         }
 
-        usleep (25000);     // just to slow animation...
-        printf("\b%c", ANIM_CHARS[state++ & 3]);
-        fflush(stdout);
+        if (progress_enabled () && (now >= next_anim))
+        {
+            printf("\b%c", ANIM_CHARS[state++ & 3]);
+            fflush(stdout);
+            next_anim = now + 100000ULL;
+        }
 
-        while ((val = *s++) != 0)
+        if (com_write (fd, burst, len) < 0)
         {
-            com_putc(fd, val);
+            printf ("\nDevice disconnected.\n");
+            return 0;
+        }
 
-            val = com_getc(fd, 0);
+        // read what came in during this burst
+        now = get_time_us () + burst_ms * 1000ULL;
+        do
+        {
+            val = com_getc_ms (fd, burst_ms);
+            if ((val == CONNECT) || (val == COM_DISCONNECT))
+                break;
+        } while (get_time_us () < now);
 
-            if (val == CONNECT)
-            {
-                printf ("\bconnected");
+        if (val == CONNECT)
+        {
+            // the bursts still queued are not needed anymore
+            com_discard (fd);
+            printf ("\bconnected");
 
-                // clear buffer from echo...
-                while (com_getc(fd, TIMEOUT) > 0);
+            // clear buffer from echo...
+            while (com_getc(fd, TIMEOUT) > 0);
 
-                sendcommand( fd, COMMAND );
+            sendcommand( fd, COMMAND );
 
-                while (1)
+            while (1)
+            {
+                switch(com_getc(fd, TIMEOUT))
                 {
-                    switch(com_getc(fd, TIMEOUT))
-                    {
-                        case COM_DISCONNECT:
-                            printf ("\nDevice disconnected.\n");
-                            return 0;
-                            break;
-                        case COMMAND:
-                            com_localecho();
-                            printf (" (one wire)");
-                            break;
-                        case SUCCESS:
-                        case COM_TIMEOUT:
-                            printf ("!\n");
-                            return 1;
-                    }
+                    case COM_DISCONNECT:
+                        printf ("\nDevice disconnected.\n");
+                        return 0;
+                        break;
+                    case COMMAND:
+                        com_localecho();
+                        printf (" (one wire)");
+                        break;
+                    case SUCCESS:
+                    case COM_TIMEOUT:
+                        printf ("!\n");
+                        return 1;
                 }
             }
-            else if (val == COM_DISCONNECT)
-            {
-                printf ("\nDevice disconnected.\n");
-                return 0;
-            }
+        }
+        else if (val == COM_DISCONNECT)
+        {
+            printf ("\nDevice disconnected.\n");
+            return 0;
         }
     }
     printf ("\nTerminated by user.\n");
@@ -823,12 +782,16 @@ int check_crc(int fd)
     int i;
     unsigned int crc1;
 
+    report_phase ("crc");
+
     sendcommand(fd, CHECK_CRC);
     crc1 = crc;
     com_putc(fd, crc1);
     com_putc(fd, crc1 >> 8);
 
     i = com_getc(fd, TIMEOUT);
+    report_end ();
+
     switch (i)
     {
         case SUCCESS:
@@ -848,111 +811,188 @@ int check_crc(int fd)
 }
 
 /**
- * prints the device signature
- *
- * @return true on success; exit on error
+ * Appends CHECK_CRC and the CRC of everything sent before
  */
-int read_info (int fd,
-               bootInfo_t *bInfo)
+static void put_check_crc (int fd)
 {
-    long i, j;
-    char s[256];
-    FILE *fp;
-
-    bInfo->crc_on = check_crc(fd);
-    if (bInfo->crc_on < 0)
-        return (0);
-
-    sendcommand(fd, REVISION);
+    com_putc_fast (fd, COMMAND);
+    com_putc_fast (fd, CHECK_CRC);
+    com_flush (fd);         // the CRC covers the command
+    com_putc_fast (fd, crc);
+    com_putc_fast (fd, crc >> 8);
+}
 
-    i = readval(fd);
-    if(i < 0)
+/**
+ * Answer of CHECK_CRC, like check_crc
+ */
+static int crc_answer (int c)
+{
+    switch (c)
     {
-        printf("Bootloader Version unknown (Fail)\n");
-        bInfo->revision = -1;
+        case SUCCESS:       return 0;
+        case FAIL:          return 1;
+        case BADCOMMAND:    return 2;
+        default:            return (c < 0) ? c : -2;
     }
-    else
+}
+
+/**
+ * Sends all queries of read_info in one burst and reads the answers
+ * in order: CRC check, revision, signature, buffer size, user flash,
+ * CRC check
+ *
+ * @return 1 on success, 0 if the queries have to be asked one by one
+ */
+static int read_info_burst (int         fd,
+                            bootInfo_t  *bInfo,
+                            long        val[4],
+                            int         *crc_last)
+{
+    static const unsigned char query[4] = { REVISION, SIGNATURE, BUFFSIZE, USERFLASH };
+    int i;
+
+    report_phase ("queries");
+
+    put_check_crc (fd);
+    for (i = 0; i < 4; i++)
     {
-        printf("Bootloader    : V%lX.%lX\n", i>>8, i&0xFF);
-        bInfo->revision = i;
+        com_putc_fast (fd, COMMAND);
+        com_putc_fast (fd, query[i]);
     }
+    put_check_crc (fd);
+    com_drain (fd);
 
-    sendcommand(fd, SIGNATURE);
+    // a device without CRC answers BADCOMMAND, sequential handles it
+    bInfo->crc_on = crc_answer (com_getc (fd, TIMEOUT));
+    if ((bInfo->crc_on != 0) && (bInfo->crc_on != 1))
+        goto fallback;
 
-    i = readval(fd);
-    if (i < 0)
+    for (i = 0; i < 4; i++)
     {
-        printf("Reading device SIGNATURE failed!\n\n");
-        return (0);
+        if ((val[i] = readval (fd, TIMEOUT)) < 0)
+            goto fallback;
     }
-    bInfo->signature = i;
 
-    if((fp = fopen("devices.txt", "r")) != NULL)
+    *crc_last = crc_answer (com_getc (fd, TIMEOUT));
+    if (*crc_last < 0)
+        goto fallback;
+
+    report_end ();
+    return 1;
+
+fallback:
+    report_end ();
+    printf("Queries       : no answer to the burst, asking one by one\n");
+
+    // let the rest of the answers pass
+    while (com_getc_ms (fd, 100) >= 0);
+    return 0;
+}
+
+/**
+ * Sends a query and reads its value
+ */
+static long query_value (int            fd,
+                         unsigned char  cmd,
+                         const char     *phase)
+{
+    long i;
+
+    report_phase (phase);
+    sendcommand(fd, cmd);
+
+    i = readval(fd, TIMEOUT);
+    report_end ();
+
+    return i;
+}
+
+/**
+ * prints the device signature
+ *
+ * @return true on success; exit on error
+ */
+int read_info (int fd,
+               bootInfo_t *bInfo)
+{
+    const device_t *dev;
+    long val[4];            // revision, signature, buffsize, userflash
+    int crc_last = -1;      // result of the CRC check after the queries
+    long i;
+
+    if (!pipeline || com_is_localecho () ||
+        !read_info_burst (fd, bInfo, val, &crc_last))
     {
-        while(fgets(s, 256, fp))
+        bInfo->crc_on = check_crc(fd);
+        if (bInfo->crc_on < 0)
+            return (0);
+
+        val[0] = query_value (fd, REVISION, "revision");
+        if ((val[1] = query_value (fd, SIGNATURE, "signature")) < 0)
         {
-            if(sscanf(s, "%lX : %s", &j, s) == 2)
-            { // valid entry
-                if(i == j)
-                {
-                    break;
-                }
-            }
-            *s = 0;
+            printf("Reading device SIGNATURE failed!\n\n");
+            return (0);
         }
-        fclose(fp);
-    }
-    else
-    {
-        // search locally...
-        for (j = 0; j < (sizeof (avr_dev) / sizeof (avrdev_t)); j++)
+        if ((val[2] = query_value (fd, BUFFSIZE, "buffsize")) < 0)
         {
-            if (i == avr_dev[j].id)
-            {
-                strcpy (s, avr_dev[j].name);
-                break;
-            }
+            printf("Reading BUFFSIZE failed!\n\n");
+            return (0);
         }
-        if (j == (sizeof (avr_dev) / sizeof (avrdev_t)))
+        if ((val[3] = query_value (fd, USERFLASH, "userflash")) < 0)
         {
-            sscanf ("(?)" , "%s", s);
-            printf("File \"devices.txt\" not found!\n");
+            printf("Reading FLASHSIZE failed!\n\n");
+            return (0);
         }
     }
-    printf("Target        : %06lX %s\n", i, s);
 
-    sendcommand(fd, BUFFSIZE);
+    i = val[0];
+    if(i < 0)
+    {
+        printf("Bootloader Version unknown (Fail)\n");
+        bInfo->revision = -1;
+    }
+    else
+    {
+        printf("Bootloader    : V%lX.%lX\n", i>>8, i&0xFF);
+        bInfo->revision = i;
+    }
+
+    i = val[1];
+    bInfo->signature = i;
 
-    i = readval(fd);
-    if (i < 0)
+    dev = device_find (i);
+    bInfo->device = dev;
+    printf("Target        : %06lX %s\n", i, dev ? dev->name : "(?)");
+    if (dev)
     {
-        printf("Reading BUFFSIZE failed!\n\n");
-        return (0);
+        printf("Flash         : %lu Byte, page %lu, boot %lu\n",
+               dev->flash, dev->pagesize, dev->bootsize);
+        if (dev->maxbaud && (baud > dev->maxbaud))
+            printf("Warning       : baudrate %d is above %lu recommended for the target\n",
+                   baud, dev->maxbaud);
     }
+
+    i = val[2];
     bInfo->buffsize = i;
 
     printf("Buffer        : %ld Byte\n", i );
 
-    sendcommand(fd, USERFLASH);
-
-    i = readval(fd);
-    if (i < 0)
-    {
-        printf("Reading FLASHSIZE failed!\n\n");
-        return (0);
-    }
-    if( i > MAXFLASH)
+    i = val[3];
+    if ((i > MAXFLASH) || (dev && (i > dev->flash)))
     {
         printf("Device and flashsize do not match!\n");
         return (0);
     }
+    if (dev && (i > dev->flash - dev->bootsize))
+        printf("Warning       : USERFLASH %ld exceeds the flash without the boot section (%lu)!\n",
+               i, dev->flash - dev->bootsize);
     bInfo->flashsize = i;
 
     printf("Size available: %ld Byte\n", i );
 
     if(bInfo->crc_on != 2)
     {
-        bInfo->crc_on = check_crc(fd);
+        bInfo->crc_on = (crc_last < 0) ? check_crc(fd) : crc_last;
         switch(bInfo->crc_on)
         {
             case 2:
@@ -979,19 +1019,260 @@ int read_info (int fd,
 
 
 
-int prog_verify (int            fd,
-                 int            mode,
-                 int            baud,
-                 int            block_size,
-                 const char     *password,
-                 const char     *device,
-                 const char     *hexfile)
+/**
+ * Sends the stream of a bundle for PROGRAM or VERIFY; when programming,
+ * after each full buffer the answer CONTINUE is awaited
+ *
+ * @return 0 on success, 2 or 3 on fail, 4 if the device can't verify
+ */
+int transfer_bundle (int            fd,
+                     const wire_t   *wire,
+                     int            program)
+{
+    const char          *text = program ? "Writing" : "Verifying";
+    unsigned long long  start_time = get_time_us ();
+    double              seconds;
+    unsigned long       i;
+    unsigned long       pos = 0;
+    unsigned long       end;
+    int                 ret;
+
+    // after a CHECK_CRC the CRC of the transfer is the one stored
+    int use_known = (crc == 0);
+
+    // Sending commands to MC
+    if (program)
+    {
+        printf("Programming   : 0x00000 - 0x%05lX\n", wire->lastaddr);
+        sendcommand(fd, PROGRAM);
+    }
+    else
+    {
+        sendcommand(fd, VERIFY);
+
+        if (verify_refused (fd))
+            return 4;
+        printf( "Verify        : 0x00000 - 0x%05lX\n", wire->lastaddr);
+    }
+
+    if (use_known)
+        com_crc_calc (FALSE);
+
+    progress_start (text, wire->streamlen);
+    for (i = 0; i <= wire->nblocks; i++)
+    {
+        end = wire->streamlen;
+        if (program && (i < wire->nblocks))
+            end = wire_blockend (wire, i);
+        else
+            i = wire->nblocks;
+
+        if (com_write (fd, wire->stream + pos, end - pos) < 0)
+        {
+            progress_done (FALSE);
+            printf("\n ---- Device disconnected ----");
+            printf("\n ---------- Failed! ----------\n");
+            com_crc_calc (TRUE);
+            return 2;
+        }
+        pos = end;
+        progress_update (pos);
+
+        if (i < wire->nblocks)
+        {
+            unsigned long long sent;
+
+            // buffer of the target is full, it answers when written
+            com_drain (fd);
+            sent = get_time_us ();
+
+            switch (com_getc (fd, TIMEOUTP))
+            {
+                case CONTINUE:
+                    // o.k.
+                    report_latency (i * wire->buffsize, get_time_us () - sent);
+                    break;
+                case COM_DISCONNECT:
+                    progress_done (FALSE);
+                    printf("\n ---- Device disconnected ----");
+                    // FALLTHROUGH
+                default:
+                    progress_done (FALSE);
+                    printf("\n ---------- Failed! ----------\n");
+                    com_crc_calc (TRUE);
+                    return 2;
+            }
+        }
+    }
+    progress_done (TRUE);
+
+    seconds = (get_time_us () - start_time) / 1000000.0;
+
+    printf("\nElapsed time  : %3.2f seconds, %.0f Bytes/sec.\n",
+           seconds,
+           (float)(wire->lastaddr + 1) / seconds);
+
+    report_data (wire->lastaddr + 1, wire->streamlen - (wire->lastaddr + 1),
+                 program ? wire->nblocks : 0);
+
+    ret = end_transfer(fd);
+
+    // the whole stream has been sent
+    if (use_known)
+    {
+        com_crc_calc (TRUE);
+        crc = program ? wire->crc : wire->verify_crc;
+    }
+
+    return ret;
+}
+
+
+/**
+ * Writes a bundle of the hexfile for the given or the connected target
+ *
+ * @return 0 on success
+ */
+int compile_bundle (int             fd,
+                    const char      *hexfile,
+                    const char      *outfile,
+                    unsigned long   signature,
+                    unsigned long   buffsize)
+{
+    bootInfo_t      bootinfo;
+    unsigned long   last_addr = 0;
+    char            *data;
+    int             ret;
+
+    printf("File          : %s\n", hexfile);
+    data = read_image_cached (hexfile, binbase, &last_addr);
+    if (data == NULL)
+        return -1;
+    printf("Size          : %ld Bytes\n", last_addr + 1);
+
+    if ((signature == 0) || (buffsize == 0))
+    {
+        // ask the target
+        memset (&bootinfo, 0, sizeof (bootinfo));
+        printf("-------------------------------------------------\n");
+        if (!connect_device (fd, password) || !read_info (fd, &bootinfo))
+        {
+            release_image (data);
+            return -3;
+        }
+        if (last_addr >= bootinfo.flashsize)
+        {
+            printf ("ERROR: Hex-file too large for target!\n"
+                    "       (needs flash-size of %ld bytes, we have %ld bytes)\n",
+                    last_addr + 1, bootinfo.flashsize);
+            release_image (data);
+            return -2;
+        }
+        signature = bootinfo.signature;
+        buffsize  = bootinfo.buffsize;
+
+        sendcommand(fd, START);         //start application
+        sendcommand(fd, START);
+    }
+
+    printf("Bundle        : %s for %06lX, buffer %lu Byte\n",
+           outfile, signature, buffsize);
+
+    ret = wire_create (outfile, data, last_addr, signature, buffsize);
+    release_image (data);
+
+    if (ret == 0)
+        printf("\n ++++++++++ Bundle successfully written! ++++++++++\n\n");
+
+    return ret;
+}
+
+
+/**
+ * Reads the image for program / verify; for erasing an empty image
+ *
+ * @return 0 on success, -1 on error
+ */
+static int load_image (int              mode,
+                       const char       *hexfile,
+                       flashImage_t     *img)
+{
+    memset (img, 0, sizeof (*img));
+
+    if (mode & AVR_CLEAN)
+    {
+        img->data = malloc(MAXFLASH);
+
+        if (img->data == NULL)
+            printf("Memory allocation error, could not get %d bytes for flash-buffer!\n",
+                   MAXFLASH);
+        else
+            memset (img->data, 0xff, MAXFLASH);
+
+        img->lastaddr = MAXFLASH - 1;
+    }
+    else if (wire_is_bundle (hexfile))
+    {
+        printf("Bundle        : %s\n", hexfile);
+
+        // map the precompiled stream
+        if (wire_open (hexfile, &img->bundle) != 0)
+            return (-1);
+        img->use_bundle = TRUE;
+        img->lastaddr   = img->bundle.lastaddr;
+
+        printf("Size          : %ld Bytes\n", img->lastaddr + 1);
+    }
+    else
+    {
+        printf("File          : %s\n", hexfile);
+
+        // read the file
+        img->data = read_image_cached (hexfile, binbase, &img->lastaddr);
+
+        printf("Size          : %ld Bytes\n", img->lastaddr + 1);
+    }
+
+    if ((img->data == NULL) && !img->use_bundle)
+    {
+        printf ("ERROR: no buffer allocated and filled, exiting!\n");
+        return (-1);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Frees the image
+ */
+static void free_image (flashImage_t *img)
+{
+    if (img->use_bundle)
+        wire_close (&img->bundle);
+    release_image (img->data);
+    img->data = NULL;
+    img->use_bundle = FALSE;
+}
+
+
+/**
+ * Connects the device and programs / verifies the image
+ *
+ * @return 0 on success, negative on error (see PV_*)
+ */
+static int prog_verify_image (int               fd,
+                              int               mode,
+                              int               block_size,
+                              const char        *password,
+                              const flashImage_t *img)
 {
-    char        *data = NULL;
     bootInfo_t  bootinfo;
+    int         ret;
+    int         result = PV_OK;
 
     // last address in hexfile
-    unsigned long last_addr = 0;
+    unsigned long last_addr = img->lastaddr;
 
     // init bootinfo
     memset (&bootinfo, 0, sizeof (bootinfo));
@@ -1001,110 +1282,1020 @@ int prog_verify (int            fd,
     bootinfo.flashsize = MAXFLASH;
     bootinfo.blocksize = block_size;
 
-    printf ("Now ");
-    if (mode & AVR_CLEAN)
-        printf ("erase, ");
-    if (mode & AVR_PROGRAM)
-        printf ("program, ");
-    if (mode & AVR_VERIFY)
-        printf ("verify, ");
-    printf ("\b\b device.\n");
+    // now start with target...
+    report_phase ("connect");
+    if (!connect_device (fd, password))
+    {
+        report_end ();
+        return (PV_NO_CONNECT);
+    }
+    report_end ();
 
-    printf("Port          : %s\n", device);
-    printf("Baudrate      : %d\n", baud);
+    if (!read_info (fd, &bootinfo))
+    {
+        return (PV_NO_INFO);
+    }
+
+    // a garbled line at this rate, a slower one is left
+    if (ladder_rest && (bootinfo.crc_on != 0) && (bootinfo.crc_on != 2))
+    {
+        sendcommand(fd, START);
+        return (PV_CRC_FAIL);
+    }
+
+    // the stream of a bundle is made for one target only
+    if (img->use_bundle &&
+        ((img->bundle.signature != bootinfo.signature) ||
+         (img->bundle.buffsize  != bootinfo.buffsize)))
+    {
+        printf ("ERROR: Bundle is made for another target!\n"
+                "       (made for %06lX with buffer %lu bytes, target is %06lX"
+                " with buffer %lu bytes)\n",
+                img->bundle.signature, img->bundle.buffsize,
+                (unsigned long)bootinfo.signature,
+                (unsigned long)bootinfo.buffsize);
+        return (PV_NO_FIT);
+    }
 
     if (mode & AVR_CLEAN)
     {
-        data = malloc(MAXFLASH);
+        last_addr = bootinfo.flashsize - 1;
+    }
 
-        if (data == NULL)
-            printf("Memory allocation error, could not get %d bytes for flash-buffer!\n",
-                   MAXFLASH);
+    // now check if program fits into flash
+    if ((mode & (AVR_PROGRAM | AVR_VERIFY)) &&
+        (last_addr >= bootinfo.flashsize  ))
+    {
+        printf ("ERROR: Hex-file too large for target!\n"
+                "       (needs flash-size of %ld bytes, we have %ld bytes)\n",
+                last_addr + 1, bootinfo.flashsize);
+        return (PV_NO_FIT);
+    }
+
+    // compare first, the same image needn't be written again
+    if ((mode & AVR_IF_CHANGED) && (mode & AVR_PROGRAM) && !(mode & AVR_CLEAN))
+    {
+        comparing = TRUE;
+        report_phase ("compare");
+        if (img->use_bundle)
+            ret = transfer_bundle (fd, &img->bundle, FALSE);
         else
-            memset (data, 0xff, MAXFLASH);
+            ret = verifyflash (fd, img->data, last_addr, &bootinfo);
+        report_end ();
+        comparing = FALSE;
 
-        last_addr = MAXFLASH - 1;
+        if (ret == 0)
+        {
+            if ((bootinfo.crc_on != 2) && (check_crc(fd) != 0))
+            {
+                printf("\nComparing failed (wrong CRC), programming anyway.\n");
+            }
+            else
+            {
+                printf("\n ++++++++++ Device unchanged, skipped programming! ++++++++++\n\n");
+                mode &= ~(AVR_PROGRAM | AVR_VERIFY);
+                result = PV_UNCHANGED;
+            }
+        }
+        else if (ret == 3)
+        {
+            printf("\nImage differs, programming.\n");
+        }
+        else if (ret != 4)
+        {
+            printf("\n ---------- Comparing failed! ----------\n\n");
+            return (PV_VERIFY_FAIL);
+        }
     }
-    else
+
+    if (mode & AVR_PROGRAM)
     {
-        printf("File          : %s\n", hexfile);
+        report_phase ("program");
+        report_latency_clear ();
+        if (img->use_bundle)
+            ret = transfer_bundle (fd, &img->bundle, TRUE);
+        else
+            ret = programflash (fd, img->data, last_addr, &bootinfo);
+        report_end ();
 
-        // read the file
-        data = read_hexfile (hexfile, &last_addr);
+        if (ret == 0)
+        {
+            if ((bootinfo.crc_on != 2) && (check_crc(fd) != 0))
+            {
+                printf("\n ---------- Programming failed (wrong CRC)! ----------\n\n");
+                result = PV_CRC_FAIL;
+            }
+            else if (mode & AVR_CLEAN)
+                printf("\n ++++++++++ Device successfully erased! ++++++++++\n\n");
+            else
+                printf("\n ++++++++++ Device successfully programmed! ++++++++++\n\n");
 
-        printf("Size          : %ld Bytes\n", last_addr + 1);
+            if (show_latency)
+                report_latency_print ();
+        }
+        else
+        {
+            printf("\n ---------- Programming failed! ----------\n\n");
+            return (PV_PROG_FAIL);
+        }
     }
-
-    if (data == NULL)
+    if (mode & AVR_VERIFY)
+    {
+        report_phase ("verify");
+        if (img->use_bundle)
+            ret = transfer_bundle (fd, &img->bundle, FALSE);
+        else
+            ret = verifyflash (fd, img->data, last_addr, &bootinfo);
+        report_end ();
+
+        if ((ret == 0) || (ret == 4))
+        {
+            if ((bootinfo.crc_on != 2) && (check_crc(fd) != 0))
+            {
+                printf("\n ---------- Verification failed (wrong CRC)! ----------\n\n");
+                result = PV_CRC_FAIL;
+            }
+            else
+                printf("\n ++++++++++ Device successfully verified! ++++++++++\n\n");
+        }
+        else
+        {
+            printf("\n ---------- Verification failed! ----------\n\n");
+            result = PV_VERIFY_FAIL;
+        }
+    }
+
+    if (!(mode & AVR_CLEAN))
+        printf("...starting application\n\n");
+
+    report_phase ("start");
+    sendcommand(fd, START);         //start application
+    sendcommand(fd, START);
+    report_end ();
+
+    return (result);
+}
+
+
+/**
+ * Sorts baudrates, fastest first
+ */
+static int compare_baud (const void *a, const void *b)
+{
+    unsigned long ba = *(const unsigned long *)a;
+    unsigned long bb = *(const unsigned long *)b;
+
+    return (ba < bb) - (ba > bb);
+}
+
+
+/**
+ * Parses -b: a baudrate, a list of baudrates separated by ','
+ * or "auto"
+ *
+ * @return number of baudrates, 0 on error
+ */
+static int parse_bauds (const char *spec)
+{
+    const char  *s = spec;
+    char        *end;
+    int         n = 0;
+
+    if (strcmp (spec, "auto") == 0)
+    {
+        for (n = 0; n < sizeof (auto_bauds) / sizeof (auto_bauds[0]); n++)
+            bauds[n] = auto_bauds[n];
+        return (n);
+    }
+
+    while (*s)
+    {
+        unsigned long value = strtoul (s, &end, 10);
+
+        if ((end == s) || ((*end != ',') && (*end != '\0')) ||
+            !com_baud_ok (value))
+        {
+            printf("Unknown baudrate (%.*s)!\n", (int)strcspn (s, ","), s);
+            return (0);
+        }
+        if (n == MAX_BAUDS)
+        {
+            printf("Too many baudrates (max. %d)!\n", MAX_BAUDS);
+            return (0);
+        }
+        bauds[n++] = value;
+        s = (*end == ',') ? end + 1 : end;
+    }
+
+    // fastest first
+    qsort (bauds, n, sizeof (bauds[0]), compare_baud);
+
+    return (n);
+}
+
+
+/**
+ * Prints the baudrate (or the ladder)
+ */
+static void print_bauds (void)
+{
+    int i;
+
+    printf("Baudrate      : ");
+    for (i = 0; i < nbauds; i++)
+        printf("%s%lu", i ? ", " : "", bauds[i]);
+    if (nbauds > 1)
+        printf(" (fastest first)");
+    printf("\n");
+}
+
+
+/**
+ * Programs / verifies the image, stepping down the baudrate ladder
+ * when the device does not connect or the CRC check fails
+ *
+ * @return 0 on success, negative on error (see PV_*)
+ */
+static int prog_verify_ladder (int                  fd,
+                               int                  mode,
+                               int                  block_size,
+                               const char           *password,
+                               const flashImage_t   *img)
+{
+    int timeout = connect_timeout;
+    int ret = PV_NO_CONNECT;
+    int i;
+
+    if (nbauds <= 1)
+        return (prog_verify_image (fd, mode, block_size, password, img));
+
+    for (i = 0; (i < nbauds) && running; i++)
+    {
+        // only the slowest rate waits as long as the user wants
+        if ((i < nbauds - 1) &&
+            ((timeout == 0) || (timeout > LADDER_TIMEOUT)))
+            connect_timeout = LADDER_TIMEOUT;
+        else
+            connect_timeout = timeout;
+
+        if (com_set_baud (fd, bauds[i]) != 0)
+        {
+            printf("Setting baudrate %lu failed (%s)!\n",
+                   bauds[i], strerror (errno));
+            continue;
+        }
+        baud = bauds[i];
+        ladder_rest = nbauds - 1 - i;
+        printf("Trying        : %lu baud\n", bauds[i]);
+
+        ret = prog_verify_image (fd, mode, block_size, password, img);
+
+        if ((ret != PV_NO_CONNECT) && (ret != PV_CRC_FAIL))
+            break;
+
+        // the application has been started, without a reset
+        // the device does not connect again
+        if ((ret == PV_CRC_FAIL) && (autoreset == NO_AUTORESET))
+        {
+            if (i < nbauds - 1)
+                printf("Stepping down : not possible, the application runs; reset "
+                       "the device and try -b %lu\n", bauds[i + 1]);
+            break;
+        }
+        if (i < nbauds - 1)
+            printf("Stepping down : %lu baud failed, trying %lu\n",
+                   bauds[i], bauds[i + 1]);
+    }
+    connect_timeout = timeout;
+    ladder_rest = 0;
+
+    if (ret >= PV_OK)
+        printf("Baudrate used : %d\n", baud);
+
+    return (ret);
+}
+
+
+/**
+ * Prints what will be done
+ */
+static void print_mode (int mode)
+{
+    printf ("Now ");
+    if (mode & AVR_CLEAN)
+        printf ("erase, ");
+    if (mode & AVR_PROGRAM)
+        printf ((mode & AVR_IF_CHANGED) ? "program (if changed), " : "program, ");
+    if (mode & AVR_VERIFY)
+        printf ("verify, ");
+    printf ("\b\b device.\n");
+}
+
+
+int prog_verify (int            fd,
+                 int            mode,
+                 int            baud,
+                 int            block_size,
+                 const char     *password,
+                 const char     *device,
+                 const char     *hexfile)
+{
+    flashImage_t    img;
+    int             ret;
+
+    print_mode (mode);
+
+    printf("Port          : %s\n", device);
+    print_bauds ();
+
+    report_phase ("load");
+    ret = load_image (mode, hexfile, &img);
+    report_end ();
+    if (ret != 0)
+    {
+        return (PV_NO_IMAGE);
+    }
+
+    printf("-------------------------------------------------\n");
+
+    ret = prog_verify_ladder (fd, mode, block_size, password, &img);
+
+    free_image (&img);
+
+    return (ret);
+}
+
+
+/**
+ * Text for the result of prog_verify
+ */
+static const char * pv_result_text (int result)
+{
+    switch (result)
+    {
+        case PV_UNCHANGED:      return "passed (unchanged, skipped)";
+        case PV_OK:             return "passed";
+        case PV_NO_IMAGE:       return "FAILED (no image)";
+        case PV_NO_FIT:         return "FAILED (image does not fit the target)";
+        case PV_NO_INFO:        return "FAILED (reading device info)";
+        case PV_NO_CONNECT:     return "FAILED (no connection)";
+        case PV_PROG_FAIL:      return "FAILED (programming)";
+        case PV_CRC_FAIL:       return "FAILED (wrong CRC)";
+        case PV_VERIFY_FAIL:    return "FAILED (verification)";
+        case PV_NO_PORT:        return "FAILED (opening port)";
+        default:                return "FAILED";
+    }
+}
+
+
+/**
+ * Sets blocksize and drain mode of a profile; the byte times are set
+ * again by com_open if the port is not open yet
+ *
+ * @return byte times to wait instead of tcdrain
+ */
+static int apply_profile (const profile_t *prof)
+{
+    bsize = prof->blocksize;
+    com_blocksize (bsize);
+    com_streaming (prof->mode != PROFILE_DRAIN);
+    com_wait_bytetime ((prof->mode == PROFILE_WAIT) ? prof->wait : 0);
+
+    return ((prof->mode == PROFILE_WAIT) ? prof->wait : 0);
+}
+
+
+/**
+ * Loads the transfer settings stored for the adaptor by --autotune,
+ * unless they are given on the command line
+ *
+ * @return byte times to wait instead of tcdrain
+ */
+static int load_profile (const char *dev,
+                         int        wait_bytetime)
+{
+    profile_t   prof;
+
+    if (!use_profile || (profile_load (dev, baud, &prof) != 0))
+        return (wait_bytetime);
+
+    printf("Profile       : blocksize %d, %s",
+           prof.blocksize, profile_mode_text (prof.mode));
+    if (prof.mode == PROFILE_WAIT)
+        printf(" %d", prof.wait);
+    printf(" (%lu Bytes/sec)\n", prof.rate);
+
+    return (apply_profile (&prof));
+}
+
+
+/**
+ * Opens the port with the settings of the profile of the adaptor,
+ * unless it is tuned
+ *
+ * @return file descriptor, negative on error
+ */
+static int open_port (const char    *dev,
+                      unsigned long rate,
+                      int           wait_bytetime,
+                      int           tune)
+{
+    int fd;
+
+    if (!tune)
+        wait_bytetime = load_profile (dev, wait_bytetime);
+
+    report_phase ("open");
+    fd = com_open (dev, rate, wait_bytetime);
+    report_end ();
+
+    if (fd == COM_NO_BAUD)
+        printf("Baudrate %lu not possible on \"%s\" (%s)!\n",
+               rate, dev, strerror (errno));
+    else if (fd < 0)
+        printf("Opening com port \"%s\" failed (%s)!\n",
+               dev, strerror (errno));
+    else
+        com_blocksize (bsize);
+
+    return (fd);
+}
+
+
+/**
+ * Measures blocksizes and drain modes with VERIFY passes over a scratch
+ * image (the flash is not written) and stores the fastest setting as
+ * profile of the adaptor. Only the data stream is timed; a setting has
+ * to beat the default (streaming, -t 16, the first one measured) by
+ * more than the spread of the passes, otherwise the default is kept.
+ * Blocks larger than the image are not tried; the sweep stops when a
+ * setting runs at the speed of the wire, nothing can beat it then, or
+ * after TUNE_MAX_S.
+ *
+ * @return 0 on success, negative on error (see PV_*)
+ */
+static int autotune (int            fd,
+                     const char     *dev)
+{
+    static const profileMode_t modes[] = { PROFILE_STREAM, PROFILE_DRAIN, PROFILE_WAIT };
+    static const int sizes[] = { 16, 64, 256, 1024, 4096 };
+
+    bootInfo_t      bootinfo;
+    profile_t       prof;
+    profile_t       best;
+    profile_t       def;
+    char            key[PATH_MAX];
+    char            *data;
+    unsigned long   size;
+    unsigned long   wire_rate = baud / 10;
+    unsigned long   pass_ms;
+    unsigned long long deadline;
+    const char      *stop = NULL;
+    double          spread = TUNE_SPREAD / 100.0;
+    int             saved_progress = progress_enabled ();
+    int             result = PV_OK;
+    int             nmodes = sizeof (modes) / sizeof (modes[0]);
+    int             nsizes = 0;
+    int             m, n, pass;
+
+    memset (&bootinfo, 0, sizeof (bootinfo));
+    memset (&best, 0, sizeof (best));
+    memset (&def, 0, sizeof (def));
+    bootinfo.flashsize = MAXFLASH;
+
+    if (!connect_device (fd, password))
+        return (PV_NO_CONNECT);
+    if (!read_info (fd, &bootinfo))
+        return (PV_NO_INFO);
+
+    size = (unsigned long)baud / 10 * TUNE_WIRE_MS / 1000;
+    if (size < TUNE_SIZE)
+        size = TUNE_SIZE;
+    if (size > bootinfo.flashsize)
+        size = bootinfo.flashsize;
+    if ((data = malloc (size)) == NULL)
+    {
+        printf("Memory allocation error!\n");
+        return (PV_NO_IMAGE);
+    }
+
+    // like code: some bytes need escaping
+    srand (1);
+    for (n = 0; n < size; n++)
+        data[n] = rand ();
+
+    // larger blocks are never filled
+    for (n = 0; n < sizeof (sizes) / sizeof (sizes[0]); n++)
+        if (sizes[n] <= size)
+            nsizes = n + 1;
+
+    // the wire time of a pass and the wait for the answer to VERIFY
+    pass_ms = (unsigned long)(size * 10000ULL / baud) + VERIFY_POLL_MS;
+
+    printf("-------------------------------------------------\n");
+    printf("Autotune      : VERIFY of %lu bytes, %d passes each, %d settings\n",
+           size, TUNE_PASSES, nmodes * nsizes);
+    printf("Duration      : about %lu seconds, at most %d; less if the wire is the limit\n",
+           (nmodes * nsizes * TUNE_PASSES * pass_ms + 999) / 1000, TUNE_MAX_S);
+    fflush(stdout);
+    deadline = get_time_us () + TUNE_MAX_S * 1000000ULL;
+
+    progress_enable (FALSE);
+    comparing = TRUE;
+    tuning = TRUE;
+
+    for (m = 0; (m < nmodes) && running && !stop; m++)
+    {
+        for (n = 0; (n < nsizes) && running && !stop; n++)
+        {
+            unsigned long long fastest = 0;
+            unsigned long long slowest = 0;
+
+            prof.blocksize = sizes[n];
+            prof.mode      = modes[m];
+            prof.wait      = (modes[m] == PROFILE_WAIT) ? 1 : 0;
+            apply_profile (&prof);
+            bootinfo.blocksize = prof.blocksize;
+
+            for (pass = 0; pass < TUNE_PASSES; pass++)
+            {
+                if (verifyflash (fd, data, size - 1, &bootinfo) == 4)
+                {
+                    result = PV_VERIFY_FAIL;
+                    goto done;
+                }
+                if ((fastest == 0) || (stream_us < fastest))
+                    fastest = stream_us;
+                if (stream_us > slowest)
+                    slowest = stream_us;
+            }
+
+            if (fastest == 0)
+                fastest = 1;
+            if ((double)(slowest - fastest) / fastest > spread)
+                spread = (double)(slowest - fastest) / fastest;
+
+            prof.rate = (size * 1000000ULL) / fastest;
+            printf("  %-6s -t %4d : %7lu Bytes/sec  (+-%.1f%%)\n",
+                   profile_mode_text (prof.mode), prof.blocksize, prof.rate,
+                   50.0 * (slowest - fastest) / fastest);
+            fflush(stdout);
+
+            if ((m == 0) && (n == 0))
+                def = prof;
+            if (prof.rate > best.rate)
+                best = prof;
+
+            // within the spread of the wire speed, nothing can beat it
+            if (prof.rate * (1.0 + spread) >= wire_rate)
+                stop = "runs at the speed of the wire";
+            else if (get_time_us () > deadline)
+                stop = "time limit reached";
+        }
+    }
+    if (stop && running && (result == PV_OK))
+        printf("Stopped       : %s, %d of %d settings measured\n", stop,
+               (m - 1) * nsizes + n, nmodes * nsizes);
+
+done:
+    tuning = FALSE;
+    comparing = FALSE;
+    progress_enable (saved_progress);
+    free (data);
+
+    sendcommand(fd, START);
+    sendcommand(fd, START);
+
+    if (result != PV_OK)
+    {
+        printf("Autotune needs the VERIFY command of the bootloader!\n");
+        return (result);
+    }
+    if (!running)
+        return (PV_NO_CONNECT);
+
+    // within the spread it is noise, not a better setting
+    if (best.rate <= def.rate * (1.0 + spread))
+    {
+        printf("No setting faster than the default by more than %.1f%%\n", 100.0 * spread);
+        best = def;
+    }
+
+    printf("Best          : -t %d, %s", best.blocksize, profile_mode_text (best.mode));
+    if (best.mode == PROFILE_WAIT)
+        printf(" %d", best.wait);
+    printf(" (%lu Bytes/sec)\n", best.rate);
+
+    if (profile_store (dev, baud, &best) != 0)
+        return (PV_NO_IMAGE);
+
+    profile_key (dev, key, sizeof (key));
+    printf("Stored for    : %s at %d baud\n", key, baud);
+
+    return (PV_OK);
+}
+
+
+/**
+ * Name of the report of one device in gang mode: the name of the
+ * port is inserted before the extension (out.json -> out-ttyUSB0.json)
+ */
+static void report_name (char           *buf,
+                         size_t         len,
+                         const char     *file,
+                         const char     *device)
+{
+    const char  *port = strrchr (device, '/');
+    const char  *ext  = strrchr (file, '.');
+
+    port = port ? port + 1 : device;
+    if ((ext == NULL) || strchr (ext, '/'))
+        ext = file + strlen (file);
+
+    snprintf (buf, len, "%.*s-%s%s", (int)(ext - file), file, port, ext);
+}
+
+
+/**
+ * Program / verify several devices at once: the image is read once,
+ * then every port gets its own process (the state of com.c is per
+ * process). The resets are staggered, the output of the processes is
+ * collected and prefixed with the port.
+ *
+ * @return number of failed devices
+ */
+static int gang_prog_verify (char           **devices,
+                             int            ndev,
+                             int            mode,
+                             unsigned long  baudrate,
+                             int            wait_bytetime)
+{
+    flashImage_t    img;
+    pid_t           *pids;
+    int             *pipes;
+    int             *results;
+    char            (*lines)[256];
+    int             *linelen;
+    int             failed = 0;
+    int             open_pipes = 0;
+    int             i;
+
+    print_mode (mode);
+    printf("Ports         : %d devices\n", ndev);
+    print_bauds ();
+
+    report_phase ("load");
+    i = load_image (mode, hexfile, &img);
+    report_end ();
+    if (i != 0)
+    {
+        return (ndev);
+    }
+    printf("-------------------------------------------------\n");
+    fflush (stdout);
+
+    pids    = calloc (ndev, sizeof (*pids));
+    pipes   = calloc (ndev, sizeof (*pipes));
+    results = calloc (ndev, sizeof (*results));
+    lines   = calloc (ndev, sizeof (*lines));
+    linelen = calloc (ndev, sizeof (*linelen));
+    if (!pids || !pipes || !results || !lines || !linelen)
+    {
+        printf("Memory allocation error!\n");
+        return (ndev);
+    }
+
+    for (i = 0; i < ndev; i++)
+    {
+        int pfd[2];
+
+        results[i] = PV_NO_PORT;
+        pipes[i]   = -1;
+
+        if (pipe (pfd) < 0)
+        {
+            perror ("ERROR: could not create pipe");
+            continue;
+        }
+
+        pids[i] = fork ();
+        if (pids[i] == 0)
+        {
+            int fd;
+            int ret;
+
+            // worker: output goes to the parent
+            close (pfd[0]);
+            dup2 (pfd[1], STDOUT_FILENO);
+            dup2 (pfd[1], STDERR_FILENO);
+            close (pfd[1]);
+            setvbuf (stdout, NULL, _IOLBF, 0);
+            progress_enable (FALSE);
+
+            // don't let all resets happen at the same time
+            usleep ((useconds_t)i * stagger * 1000);
+
+            fd = open_port (devices[i], baudrate, wait_bytetime, FALSE);
+            if (fd < 0)
+                exit (-PV_NO_PORT);
+
+            ret = prog_verify_ladder (fd, mode, bsize, password, &img);
+
+            com_close (fd);
+            if (reportfile)
+            {
+                char name[PATH_MAX];
+
+                report_print ();
+                report_name (name, sizeof (name), reportfile, devices[i]);
+                report_write (name, devices[i], baud, hexfile, ret,
+                              pv_result_text (ret));
+            }
+            fflush (stdout);
+            // PV_UNCHANGED gives 255, read back as signed
+            exit (-ret);
+        }
+
+        close (pfd[1]);
+        if (pids[i] < 0)
+        {
+            perror ("ERROR: could not start worker");
+            close (pfd[0]);
+            continue;
+        }
+        pipes[i] = pfd[0];
+        open_pipes++;
+    }
+
+    // collect the output line by line
+    while (open_pipes > 0)
+    {
+        struct pollfd   pfds[ndev];
+        int             n = 0;
+
+        for (i = 0; i < ndev; i++)
+        {
+            pfds[i].fd      = pipes[i];
+            pfds[i].events  = POLLIN;
+            pfds[i].revents = 0;
+        }
+
+        if (poll (pfds, ndev, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (i = 0; i < ndev; i++)
+        {
+            char    buf[256];
+            char    *name;
+            int     j;
+
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            name = strrchr (devices[i], '/');
+            name = name ? name + 1 : devices[i];
+
+            n = read (pipes[i], buf, sizeof (buf));
+            for (j = 0; j < n; j++)
+            {
+                if ((buf[j] == '\n') || (linelen[i] == sizeof (lines[i]) - 1))
+                {
+                    lines[i][linelen[i]] = '\0';
+                    if (linelen[i] > 0)
+                        printf ("[%s] %s\n", name, lines[i]);
+                    linelen[i] = 0;
+                }
+                if (buf[j] != '\n')
+                    lines[i][linelen[i]++] = buf[j];
+            }
+            if (n <= 0)
+            {
+                if (linelen[i] > 0)
+                {
+                    lines[i][linelen[i]] = '\0';
+                    printf ("[%s] %s\n", name, lines[i]);
+                }
+                close (pipes[i]);
+                pipes[i] = -1;
+                open_pipes--;
+            }
+        }
+        fflush (stdout);
+    }
+
+    for (i = 0; i < ndev; i++)
+    {
+        int status;
+
+        if ((pids[i] > 0) && (waitpid (pids[i], &status, 0) == pids[i]))
+        {
+            if (WIFEXITED (status))
+                results[i] = -(signed char)WEXITSTATUS (status);
+            else
+                results[i] = PV_NO_CONNECT;
+        }
+    }
+
+    printf("=================================================\n");
+    for (i = 0; i < ndev; i++)
+    {
+        printf("%-40s: %s\n", devices[i], pv_result_text (results[i]));
+        if (results[i] < PV_OK)
+            failed++;
+    }
+    printf("=================================================\n");
+    printf("%d of %d devices passed.\n\n", ndev - failed, ndev);
+
+    free_image (&img);
+    free (pids);
+    free (pipes);
+    free (results);
+    free (lines);
+    free (linelen);
+
+    return (failed);
+}
+
+
+/**
+ * Splits a list of devices (separated by ',') and expands wildcards
+ *
+ * @return number of devices
+ */
+static int expand_devices (const char   *spec,
+                           char         ***devices)
+{
+    glob_t  g;
+    char    *list = strdup (spec);
+    char    *part;
+    char    *save = NULL;
+    int     flags = GLOB_NOCHECK;
+    size_t  i;
+    int     n = 0;
+
+    *devices = NULL;
+    if (list == NULL)
+        return 0;
+
+    memset (&g, 0, sizeof (g));
+    for (part = strtok_r (list, ",", &save); part; part = strtok_r (NULL, ",", &save))
+    {
+        glob (part, flags, NULL, &g);
+        flags |= GLOB_APPEND;
+    }
+    free (list);
+
+    *devices = calloc (g.gl_pathc + 1, sizeof (char *));
+    for (i = 0; *devices && (i < g.gl_pathc); i++)
+    {
+        (*devices)[n++] = strdup (g.gl_pathv[i]);
+    }
+    if (flags & GLOB_APPEND)
+        globfree (&g);
+
+    return n;
+}
+
+
+static int handle_input (int    input,
+                         FILE   *output);
+
+/**
+ * Waits until the output queue has room again (SEND_ROOM), or until it
+ * is empty and delay msec more; the device output is shown meanwhile
+ * and CTRL C on the keyboard stops sending
+ *
+ * @return 1 to go on, 0 if stopped, -1 if the device is gone
+ */
+static int send_wait (int   fd,
+                      int   delay)
+{
+    unsigned long long  until = 0;
+    unsigned long long  now;
+    struct pollfd       pfd[2];
+    int                 queued;
+    int                 c;
+
+    pfd[0].fd     = fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd     = fileno (fp_stdio);
+    pfd[1].events = POLLIN;
+
+    while (running)
+    {
+        queued = com_outq (fd);
+        now    = get_time_us ();
+
+        if (delay == SEND_ROOM)
+        {
+            // queue unknown (-1): the next write waits for room
+            if (queued < SEND_QUEUE)
+                return 1;
+        }
+        else if (queued <= 0)
+        {
+            if (until == 0)
+                until = now + delay * 1000ULL;
+            if (now >= until)
+                return 1;
+        }
+
+        pfd[0].revents = pfd[1].revents = 0;
+        if ((com_rx_pending () == 0) && (poll (pfd, 2, 5) <= 0))
+            continue;
+
+        if ((com_rx_pending () > 0) || (pfd[0].revents & POLLIN))
+        {
+            if (handle_input (fd, fp_stdio) < 0)
+                return -1;
+        }
+        if (pfd[1].revents & POLLIN)
+        {
+            while ((c = getc (fp_stdio)) != EOF)
+                if (c == CTRLC)
+                    return 0;
+            clearerr (fp_stdio);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Sends a file like typed (LF becomes CR) at line rate: the output
+ * queue is kept filled instead of draining every character
+ *
+ * @return FALSE if the device is gone
+ */
+static int send_file (int           fd,
+                      const char    *filename)
+{
+    unsigned long long  start = get_time_us ();
+    unsigned long       sent = 0;
+    unsigned long       lines = 0;
+    int                 old_ixon = FALSE;
+    int                 ok = 1;
+    int                 c;
+    FILE                *fp;
+
+    if ((fp = fopen (filename, "r")) == NULL)
     {
-        printf ("ERROR: no buffer allocated and filled, exiting!\n");
-        return (-1);
+        printf ("\nFile \"%s\" open failed: %s!\n", filename, strerror (errno));
+        return (TRUE);
     }
 
-    printf("-------------------------------------------------\n");
-
-    // now start with target...
-    if (connect_device (fd, password))
-    {
-        if (!read_info (fd, &bootinfo))
-        {
-            return (-3);
-        }
+    printf ("\n== SEND: %s ==\n", filename);
+    fflush (stdout);
 
-        if (mode & AVR_CLEAN)
-        {
-            last_addr = bootinfo.flashsize - 1;
-        }
+    if (xonxoff)
+        old_ixon = set_tty_xonxoff (fd, TRUE);
 
-        // now check if program fits into flash
-        if ((mode & (AVR_PROGRAM | AVR_VERIFY)) &&
-            (last_addr >= bootinfo.flashsize  ))
+    while ((ok > 0) && ((c = getc (fp)) != EOF))
+    {
+        if (c == '\r')
+            continue;
+        if (c == '\n')
         {
-            printf ("ERROR: Hex-file too large for target!\n"
-                    "       (needs flash-size of %ld bytes, we have %ld bytes)\n",
-                    last_addr + 1, bootinfo.flashsize);
-            return (-2);
+            c = '\r';
+            lines++;
         }
+        com_putc_fast (fd, c);
+        sent++;
 
-        if (mode & AVR_PROGRAM)
+        if ((c == '\r') && line_delay)
         {
-            if (programflash (fd, data, last_addr, &bootinfo) == 0)
-            {
-                if ((bootinfo.crc_on != 2) && (check_crc(fd) != 0))
-                    printf("\n ---------- Programming failed (wrong CRC)! ----------\n\n");
-                else if (mode & AVR_CLEAN)
-                    printf("\n ++++++++++ Device successfully erased! ++++++++++\n\n");
-                else
-                    printf("\n ++++++++++ Device successfully programmed! ++++++++++\n\n");
-            }
-            else
-            {
-                printf("\n ---------- Programming failed! ----------\n\n");
-                return (-5);
-            }
+            com_flush (fd);
+            ok = send_wait (fd, line_delay);
         }
-        if (mode & AVR_VERIFY)
+        else if ((sent % SEND_CHUNK) == 0)
         {
-            if (verifyflash (fd, data, last_addr, &bootinfo) == 0)
-            {
-                if ((bootinfo.crc_on != 2) && (check_crc(fd) != 0))
-                    printf("\n ---------- Verification failed (wrong CRC)! ----------\n\n");
-                else
-                    printf("\n ++++++++++ Device successfully verified! ++++++++++\n\n");
-            }
-            else
-                printf("\n ---------- Verification failed! ----------\n\n");
+            com_flush (fd);
+            ok = send_wait (fd, SEND_ROOM);
         }
+    }
+    com_flush (fd);
+    fclose (fp);
 
-        if (!(mode & AVR_CLEAN))
-            printf("...starting application\n\n");
-
-        sendcommand(fd, START);         //start application
-        sendcommand(fd, START);
+    if (xonxoff)
+    {
+        // what XOFF holds in the queue must not be released into the
+        // device by switching IXON off: wait for it, or drop it if stopped
+        if (ok > 0)
+            ok = send_wait (fd, 0);
+        if (ok == 0)
+            com_discard (fd);
+        set_tty_xonxoff (fd, old_ixon);
     }
-    free (data);
 
-    return 0;
+    printf ("\n== SEND: %lu bytes, %lu lines in %.2f seconds%s ==\n",
+            sent, lines, (get_time_us () - start) / 1000000.0,
+            (ok == 0) ? ", stopped" : "");
+    fflush (stdout);
+
+    return (ok >= 0);
 }
 
 
@@ -1141,10 +2332,11 @@ static int handle_keyboard (FILE  *input,
                 break;
 
             case '\n':
-                com_putc (output, '\r');
+                com_putc_fast (output, '\r');
                 break;
 
             case CTRLF:
+                com_flush (output);
                 tcsetattr (desc_in, TCSAFLUSH, &old_term);
                 printf ("\nEnter Filename: ");
                 scanf ("%s", fname);
@@ -1153,6 +2345,7 @@ static int handle_keyboard (FILE  *input,
                 break;
 
             case CTRLP:
+                com_flush (output);
                 tcsetattr (desc_in, TCSAFLUSH, &old_term);
                 if (autoreset != NO_AUTORESET)
                 {
@@ -1168,6 +2361,7 @@ static int handle_keyboard (FILE  *input,
                 break;
 
             case CTRLV:
+                com_flush (output);
                 tcsetattr (desc_in, TCSAFLUSH, &old_term);
                 if (autoreset != NO_AUTORESET)
                 {
@@ -1183,6 +2377,7 @@ static int handle_keyboard (FILE  *input,
                 break;
 
             case CTRLE:
+                com_flush (output);
                 tcsetattr (desc_in, TCSAFLUSH, &old_term);
                 printf("\n== ERASE:   Reset Target Device ==============\n");
                 prog_verify (output, AVR_PROGRAM | AVR_CLEAN,
@@ -1190,6 +2385,22 @@ static int handle_keyboard (FILE  *input,
                 tcsetattr (desc_in, TCSAFLUSH, &curr_term);
                 break;
 
+            case CTRLU:
+                com_flush (output);
+                if (sendfile == NULL)
+                {
+                    static char sname[1024+1];
+
+                    tcsetattr (desc_in, TCSAFLUSH, &old_term);
+                    printf ("\nEnter file to send: ");
+                    if (scanf ("%1024s", sname) == 1)
+                        sendfile = sname;
+                    tcsetattr (desc_in, TCSAFLUSH, &curr_term);
+                }
+                if (sendfile && !send_file (output, sendfile))
+                    return (FALSE);
+                break;
+
             case EOF:
                 break;
 
@@ -1198,11 +2409,15 @@ static int handle_keyboard (FILE  *input,
                 break;
 
             default:
-                com_putc (output, (char) char_in);
+                com_putc_fast (output, (char) char_in);
                 break;
         }
     }
 
+    /* what was typed or pasted goes out at once, without draining */
+    com_flush (output);
+    clearerr (input);
+
     return (TRUE);
 }
 
@@ -1212,43 +2427,203 @@ static int handle_keyboard (FILE  *input,
  *      Handle V24 input
  *
  ****************************************************************************/
+/**
+ * Writes the runs of the terminal output, partial writes are continued
+ *
+ * @return 0 on success
+ */
+static int write_runs (int          fd,
+                       struct iovec *iov,
+                       int          n)
+{
+    ssize_t w;
+
+    while (n > 0)
+    {
+        w = writev (fd, iov, n);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        // skip what is written
+        while ((n > 0) && ((size_t)w >= iov->iov_len))
+        {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
 static int handle_input (int    input,
                          FILE   *output)
 {
-    static char         readbuf[1024+1];
-    int                 i;
-    int                 bytes_read;
+    static char         *readbuf = NULL;
+    static size_t       size = 0;
+    struct iovec        iov[TERM_IOV];
+    int                 niov = 0;
+    int                 out = fileno (output);
+    char                *p, *end, *stop;
+    char                *cr, *esc;
+    size_t              len = 0;
+    int                 n = 0;
+
+    // about 50ms of the line at once
+    if (readbuf == NULL)
+    {
+        size = baud / 10 / 20;
+        if (size < TERM_BUF_MIN)
+            size = TERM_BUF_MIN;
+        if (size > TERM_BUF_MAX)
+            size = TERM_BUF_MAX;
+        if ((readbuf = malloc (size)) == NULL)
+            return -1;
+    }
+
+    /* take what has arrived, stamped for the capture right away */
+    while ((len < size) && ((n = com_read (input, readbuf + len, size - len)) > 0))
+    {
+        capture_data (readbuf + len, n);
+        len += n;
+    }
+
+    /* the patterns of the triggers, the actions are taken after the output */
+    trigger_scan (readbuf, len);
+
+    /* anything printed by the keyboard handler goes first */
+    fflush (output);
 
-    /* handle V24 input here */
-    do
+    /* replace possible CR/LF with LF only, drop escape sequences: the
+       runs in between are written as they are */
+    p   = readbuf;
+    end = readbuf + len;
+
+    if (esc_seq && (p < end))
+    {
+        /* second byte of a sequence from the last buffer */
+        esc_seq = 0;
+        p++;
+    }
+    cr  = memchr (p, '\r', end - p);
+    esc = memchr (p, 27, end - p);
+
+    while (p < end)
     {
-        bytes_read = com_read (input, readbuf, sizeof (readbuf) - 1);
+        stop = end;
+        if (cr && (cr < stop))
+            stop = cr;
+        if (esc && (esc < stop))
+            stop = esc;
 
-        /* replace possible CR/LF with LF only */
-        for (i = 0; i < bytes_read; i++)
+        if (stop > p)
         {
-            if (esc_seq)
+            iov[niov].iov_base = p;
+            iov[niov].iov_len  = stop - p;
+            if (++niov == TERM_IOV)
             {
-                esc_seq = 0;
+                if (write_runs (out, iov, niov) < 0)
+                    return -1;
+                niov = 0;
             }
+        }
+        if (stop == end)
+            break;
+
+        if (stop == cr)
+        {
+            p  = cr + 1;
+            cr = memchr (p, '\r', end - p);
+        }
+        else
+        {
+            /* Escape, ignore next as well */
+            p = esc + 1;
+            if (p < end)
+                p++;
             else
-            {
-                switch (readbuf[i])
+                esc_seq++;
+            if (cr && (cr < p))
+                cr = memchr (p, '\r', end - p);
+            esc = memchr (p, 27, end - p);
+        }
+    }
+
+    if (write_runs (out, iov, niov) < 0)
+        return -1;
+
+    return (n < 0) ? n : 0;
+}
+
+/**
+ * Takes the actions of the triggers that have matched; each one is
+ * noted in the capture
+ *
+ * @return FALSE if the device is gone
+ */
+static int run_triggers (int fd)
+{
+    const trigger_t *t;
+    const char      *file;
+    char            mark[PATH_MAX + 64];
+    int             mode;
+    int             ret;
+
+    while ((t = trigger_next ()) != NULL)
+    {
+        printf ("\n== TRIGGER: \"%s\" -> %s ==\n", t->spec, trigger_action_name (t->action));
+
+        switch (t->action)
+        {
+            case TRIGGER_PROGRAM:
+            case TRIGGER_VERIFY:
+                file = t->arg ? t->arg : hexfile;
+                mode = (t->action == TRIGGER_PROGRAM) ? AVR_PROGRAM : AVR_VERIFY;
+                if (file == NULL)
                 {
-                    case '\r':
-                        break;
-                    case 27:    /* Escape, ignore next as well */
-                        esc_seq++;
-                        break;
-                    default:
-                        putc (readbuf[i], output);
+                    printf ("No file to %s!\n", trigger_action_name (t->action));
+                    break;
                 }
-            }
+                tcsetattr (fileno (fp_stdio), TCSAFLUSH, &old_term);
+                ret = prog_verify (fd, mode, baud, bsize, password, device, file);
+                tcsetattr (fileno (fp_stdio), TCSAFLUSH, &curr_term);
+
+                snprintf (mark, sizeof (mark), "%s %s: %s",
+                          trigger_action_name (t->action), file, pv_result_text (ret));
+                printf ("\n== TRIGGER: %s ==\n", mark);
+                capture_marker (mark);
+                trigger_restart ();
+                break;
+
+            case TRIGGER_SEND:
+                if (com_write (fd, (const unsigned char *)t->arg, t->alen) < 0)
+                    return (FALSE);
+                break;
+
+            case TRIGGER_RESET:
+                com_set_dtr (fd, TRUE);
+                usleep (reset_pulse * 1000);
+                com_set_dtr (fd, FALSE);
+                capture_marker ("reset");
+                trigger_restart ();
+                break;
+
+            case TRIGGER_MARK:
+                capture_marker (t->arg ? t->arg : t->spec);
+                break;
         }
-    } while (bytes_read > 0);
-    fflush (output);
+        fflush (stdout);
+    }
 
-    return (bytes_read);
+    return (TRUE);
 }
 
 /*****************************************************************************
@@ -1263,6 +2638,7 @@ static void do_v24 (int iFd)
     int                 ok;
     int                 max_select;
     struct timeval      timeout;
+    struct timeval      *wait;
     fd_set              fdset;
     int                 ret_val;
 
@@ -1289,6 +2665,7 @@ static void do_v24 (int iFd)
     printf("| CTRL P: program file                          |\n");
     printf("| CTRL V: verify file                           |\n");
     printf("| CTRL E: erase device                          |\n");
+    printf("| CTRL U: send file                             |\n");
     printf("=================================================\n");
 
     tcgetattr (fileno (fp_stdio), &old_term);
@@ -1307,24 +2684,59 @@ static void do_v24 (int iFd)
     /* set new timeout on V24, we want responsive system */
     old_timeout = set_tty_timeout (iFd, 0);   /* no wait */
 
+    if (capturefile)
+    {
+        if (capture_open (capturefile, capture_raw, capture_rotate) < 0)
+        {
+            set_tty_timeout (iFd, old_timeout);
+            tcsetattr (stdio, TCSAFLUSH, &old_term);
+            fclose (fp_stdio);
+            return;
+        }
+        printf("Capture       : %s\n", capturefile);
+    }
+
     ok = TRUE;
 
-    do
+    /* send the file right away */
+    if (sendfile && !send_file (iFd, sendfile))
+        ok = FALSE;
+
+    while (ok && running)
     {
         FD_ZERO (&fdset);
         FD_SET (iFd, &fdset);
         FD_SET (stdio, &fdset);
         max_select = (iFd > stdio) ? iFd : stdio;
 
-        /* -- set max. waittime -- */
-        timeout.tv_sec  = 1;
-        timeout.tv_usec = 500000;
+        /* -- wait for input; a started escape sequence times out -- */
+        wait = NULL;
+        if (esc_seq)
+        {
+            timeout.tv_sec  = 1;
+            timeout.tv_usec = 500000;
+            wait = &timeout;
+        }
+
+        /* -- data already received, don't wait -- */
+        if (com_rx_pending () > 0)
+        {
+            timeout.tv_sec  = 0;
+            timeout.tv_usec = 0;
+            wait = &timeout;
+        }
 
         errno = 0;
 
-        ret_val = select (max_select + 1, &fdset, NULL, NULL, &timeout);
+        ret_val = select (max_select + 1, &fdset, NULL, NULL, wait);
 
-        if (ret_val > 0)
+        if ((ret_val == 0) && (com_rx_pending () > 0))
+        {
+            /* handle buffered V24 input */
+            if (handle_input (iFd, fp_stdio) < 0)
+                ok = FALSE;
+        }
+        else if (ret_val > 0)
         {
             /* -- we got something on stdin ?? -- */
             if (FD_ISSET (stdio, &fdset))
@@ -1359,7 +2771,13 @@ static void do_v24 (int iFd)
             /* just timeout */
             esc_seq = 0;
         }
-    } while (ok && running);
+
+        /* -- actions of the triggers, after the output -- */
+        if (ok && !run_triggers (iFd))
+            ok = FALSE;
+    }
+
+    capture_close ();
 
     /* reset old timeout */
     set_tty_timeout (iFd, old_timeout);
@@ -1377,9 +2795,19 @@ int main(int argc, char *argv[])
     int     fd = 0;
     int     mode = 0;
     int     wait_bytetime = 0;  // as default, use tcdrain instead of waiting
+    int     ret = PV_OK;
 
-    // default values
-    speed_t     baudid = B0;
+    // devices given by -d
+    char    **devices = NULL;
+    int     ndev;
+
+    // bundle to compile
+    const char      *outfile = NULL;
+    unsigned long   signature = 0;
+    unsigned long   buffsize = 0;
+
+    // user entries of the device table
+    const char      *devfile = NULL;
 
     struct tms timestruct;
     struct sigaction sa;
@@ -1414,6 +2842,93 @@ int main(int argc, char *argv[])
             usage (argv[0]);
             exit (0);
         }
+        else if (strcmp (argv[i], "--selftest") == 0)
+        {
+            int errors = crc_selftest ();
+
+            printf ("CRC selftest  : %s (%d errors)\n",
+                    errors ? "FAILED" : "OK", errors);
+            exit (errors ? 1 : 0);
+        }
+        else if (strcmp (argv[i], "--compile") == 0)
+        {
+            mode |= AVR_COMPILE;
+        }
+        else if (strcmp (argv[i], "-o") == 0)
+        {
+            i++;
+            if (i < argc)
+                outfile = argv[i];
+        }
+        else if (strcmp (argv[i], "--signature") == 0)
+        {
+            i++;
+            if (i < argc)
+                signature = strtoul (argv[i], NULL, 16);
+        }
+        else if (strcmp (argv[i], "--buffsize") == 0)
+        {
+            i++;
+            if (i < argc)
+                buffsize = strtoul (argv[i], NULL, 0);
+        }
+        else if (strcmp (argv[i], "--devices") == 0)
+        {
+            i++;
+            if (i < argc)
+                devfile = argv[i];
+        }
+        else if (strcmp (argv[i], "--no-cache") == 0)
+        {
+            image_cache (FALSE);
+        }
+        else if (strcmp (argv[i], "--base") == 0)
+        {
+            i++;
+            if (i < argc)
+                binbase = strtoul (argv[i], NULL, 0);
+        }
+        else if (strcmp (argv[i], "--stagger") == 0)
+        {
+            i++;
+            if (i < argc)
+                stagger = atoi(argv[i]);
+        }
+        else if (strcmp (argv[i], "--reset-pulse") == 0)
+        {
+            i++;
+            if (i < argc)
+                reset_pulse = atoi(argv[i]);
+        }
+        else if (strcmp (argv[i], "--retry") == 0)
+        {
+            i++;
+            if (i < argc)
+                retry_period = atoi(argv[i]);
+        }
+        else if (strcmp (argv[i], "--report") == 0)
+        {
+            i++;
+            if (i < argc)
+                reportfile = argv[i];
+        }
+        else if (strcmp (argv[i], "--latency") == 0)
+        {
+            show_latency = TRUE;
+        }
+        else if (strcmp (argv[i], "--slow") == 0)
+        {
+            i++;
+            if (i < argc)
+                report_latency_limit (strtoul (argv[i], NULL, 0) * 1000UL);
+            show_latency = TRUE;
+        }
+        else if (strcmp (argv[i], "--timeout") == 0)
+        {
+            i++;
+            if (i < argc)
+                connect_timeout = atoi(argv[i]);
+        }
         else if (strcmp (argv[i], "-d") == 0)
         {
             i++;
@@ -1424,7 +2939,7 @@ int main(int argc, char *argv[])
         {
             i++;
             if (i < argc)
-                baud = atoi(argv[i]);
+                baudspec = argv[i];
         }
         else if (strcmp (argv[i], "-v") == 0)
         {
@@ -1434,6 +2949,10 @@ int main(int argc, char *argv[])
         {
             mode |= AVR_PROGRAM;
         }
+        else if (strcmp (argv[i], "--if-changed") == 0)
+        {
+            mode |= AVR_IF_CHANGED;
+        }
         else if (strcmp (argv[i], "-e") == 0)
         {
             mode |= AVR_CLEAN;
@@ -1442,6 +2961,44 @@ int main(int argc, char *argv[])
         {
             mode |= AVR_TERMINAL;
         }
+        else if (strcmp (argv[i], "--capture") == 0)
+        {
+            i++;
+            if (i < argc)
+                capturefile = argv[i];
+        }
+        else if (strcmp (argv[i], "--on") == 0)
+        {
+            if ((i + 2 >= argc) || (trigger_add (argv[i + 1], argv[i + 2]) < 0))
+                usage(argv[0]);
+            i += 2;
+        }
+        else if (strcmp (argv[i], "--send") == 0)
+        {
+            i++;
+            if (i < argc)
+                sendfile = argv[i];
+        }
+        else if (strcmp (argv[i], "--line-delay") == 0)
+        {
+            i++;
+            if (i < argc)
+                line_delay = atoi (argv[i]);
+        }
+        else if (strcmp (argv[i], "--xonxoff") == 0)
+        {
+            xonxoff = TRUE;
+        }
+        else if (strcmp (argv[i], "--capture-raw") == 0)
+        {
+            capture_raw = TRUE;
+        }
+        else if (strcmp (argv[i], "--capture-rotate") == 0)
+        {
+            i++;
+            if (i < argc)
+                capture_rotate = strtoull (argv[i], NULL, 0) * 1024ULL * 1024ULL;
+        }
         else if (strcmp (argv[i], "-r") == 0)
         {
             autoreset = NO_AUTORESET;
@@ -1460,6 +3017,7 @@ int main(int argc, char *argv[])
                 printf ("Blocksize %d not allowed, setting it to 1\n", bsize);
                 bsize = 1;
             }
+            use_profile = FALSE;
         }
         else if (strcmp (argv[i], "-P") == 0)
         {
@@ -1467,11 +3025,29 @@ int main(int argc, char *argv[])
             if (i < argc)
                 password = argv[i];
         }
+        else if (strcmp (argv[i], "-D") == 0)
+        {
+            com_streaming (FALSE);
+            use_profile = FALSE;
+        }
         else if (strcmp (argv[i], "-w") == 0)
         {
             i++;
             if (i < argc)
                 wait_bytetime = atoi(argv[i]);
+            use_profile = FALSE;
+        }
+        else if (strcmp (argv[i], "--autotune") == 0)
+        {
+            mode |= AVR_TUNE;
+        }
+        else if (strcmp (argv[i], "--no-profile") == 0)
+        {
+            use_profile = FALSE;
+        }
+        else if (strcmp (argv[i], "--pipeline") == 0)
+        {
+            pipeline = TRUE;
         }
         else
         {
@@ -1479,41 +3055,129 @@ int main(int argc, char *argv[])
         }
     }
 
-    if ((hexfile == NULL) && (mode & (AVR_PROGRAM | AVR_VERIFY)))
+    // entries of the user are merged once
+    if (device_load (devfile) < 0)
+        return 1;
+
+    if ((hexfile == NULL) && (mode & (AVR_PROGRAM | AVR_VERIFY | AVR_COMPILE)))
     {
         printf("No hexfile specified!\n");
         usage(argv[0]);
     }
 
+    if ((mode & AVR_COMPILE) && (outfile == NULL))
+    {
+        printf("No output file for the bundle specified!\n");
+        usage(argv[0]);
+    }
+
+    // bundle for a known target, no device needed
+    if ((mode & AVR_COMPILE) && signature && buffsize)
+    {
+        return (compile_bundle (-1, hexfile, outfile, signature, buffsize) ? 1 : 0);
+    }
+
     if (mode == 0)
     {
         printf("No Verify / Program specified!\n");
         usage(argv[0]);
     }
 
+    if ((mode & AVR_IF_CHANGED) && !(mode & AVR_PROGRAM))
+    {
+        printf("--if-changed needs '-p'!\n");
+        usage(argv[0]);
+    }
+
+    if (capturefile && !(mode & AVR_TERMINAL))
+    {
+        printf("--capture needs '-T'!\n");
+        usage(argv[0]);
+    }
+
+    if (sendfile && !(mode & AVR_TERMINAL))
+    {
+        printf("--send needs '-T'!\n");
+        usage(argv[0]);
+    }
+
+    if (trigger_count () && !(mode & AVR_TERMINAL))
+    {
+        printf("--on needs '-T'!\n");
+        usage(argv[0]);
+    }
+
+    if (trigger_count () && (trigger_build () < 0))
+        exit(1);
+
+    if ((reset_pulse < 1) || (retry_period <= reset_pulse))
+    {
+        printf("Reset pulse %d ms / retry period %d ms not possible!\n",
+               reset_pulse, retry_period);
+        usage(argv[0]);
+    }
+
     // Checking baudrate
-    baudid = get_baudid (baud);
+    nbauds = parse_bauds (baudspec);
 
-    if (baudid == B0)
+    if (nbauds == 0)
     {
-        printf("Unknown baudrate (%i)!\nUse standard like: "
-               "50, 110, 150, 300, 600, 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400\n",
-               baud);
+        printf("Use standard like: "
+               "50, 110, 150, 300, 600, 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400\n"
+               "(other rates like 250000, 500000, 1000000 on Linux only)\n"
+               "a list like 230400,115200,57600 or auto\n");
         usage(argv[0]);
     }
+    baud = bauds[0];
+
+    // several devices (list or wildcard): program them in parallel
+    ndev = expand_devices (device, &devices);
+    if (ndev > 1)
+    {
+        if (mode & (AVR_TERMINAL | AVR_COMPILE | AVR_TUNE))
+        {
+            printf("Terminal mode, compiling a bundle and autotune need exactly one device!\n");
+            usage(argv[0]);
+        }
+        if (!(mode & (AVR_PROGRAM | AVR_VERIFY)))
+        {
+            printf("No Verify / Program specified!\n");
+            usage(argv[0]);
+        }
 
-    fd = com_open(device, baudid, wait_bytetime);
+        // a missing device must not block the others
+        if (connect_timeout == 0)
+            connect_timeout = 10;
+
+        ret = gang_prog_verify (devices, ndev, mode, baud, wait_bytetime);
+        return ((ret > 125) ? 125 : ret);
+    }
+    else if (ndev == 1)
+    {
+        device = devices[0];
+    }
 
+    fd = open_port (device, baud, wait_bytetime, mode & AVR_TUNE);
     if (fd < 0)
+        exit (-PV_NO_PORT);
+
+    if (mode & AVR_TUNE)
     {
-        printf("Opening com port \"%s\" failed (%s)!\n",
-               device, strerror (errno));
-        exit(2);
+        ret = autotune (fd, device);
+        com_close (fd);
+        return (-ret);
+    }
+
+    if (mode & AVR_COMPILE)
+    {
+        i = compile_bundle (fd, hexfile, outfile, signature, buffsize);
+        com_close (fd);
+        return (i ? 1 : 0);
     }
 
     if (mode & (AVR_PROGRAM | AVR_VERIFY))
     {
-        prog_verify (fd, mode, baud, bsize, password, device, hexfile);
+        ret = prog_verify (fd, mode, baud, bsize, password, device, hexfile);
     }
     else if (mode & (AVR_CLEAN))
     {
@@ -1527,7 +3191,14 @@ int main(int argc, char *argv[])
         do_v24 (fd);
 
     com_close(fd);                //close open com port
-    return 0;
+
+    if (reportfile && (mode & (AVR_PROGRAM | AVR_VERIFY)))
+    {
+        report_print ();
+        report_write (reportfile, device, baud, hexfile, ret, pv_result_text (ret));
+    }
+
+    return ((ret == PV_UNCHANGED) ? 0 : -ret);
 }
 
 /* end of file */
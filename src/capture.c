@@ -0,0 +1,404 @@
+/**
+ * Capture of the terminal mode for the bootloader of Peter Dannegger
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+
+/// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "capture.h"
+
+
+#define TRUE    1
+#define FALSE   0
+
+#define FLUSH_NS        200000000L  // the writer looks at least every 200ms
+
+// a chunk in the ring: the header, followed by len bytes
+typedef struct
+{
+    unsigned long long  mono;       // usec, CLOCK_MONOTONIC
+    unsigned long long  real;       // usec since the epoch
+    size_t              len;
+    int                 mark;       // the bytes are the text of a marker
+} chunk_t;
+
+
+/// Attributes
+
+static unsigned char        *ring = NULL;
+static size_t               head = 0;       // written by capture_data
+static size_t               tail = 0;       // written by the writer
+static unsigned long long   dropped = 0;
+
+static pthread_t            thread;
+static pthread_mutex_t      lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       wake;
+static int                  running = FALSE;
+
+static const char           *name;
+static FILE                 *fp = NULL;
+static int                  raw_mode;
+static unsigned long long   rotate_size;
+static unsigned long long   written;
+static int                  generation = 0;
+static int                  line_start = TRUE;
+
+
+/**
+ * Current time of a clock in usec
+ */
+static unsigned long long clock_us (clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime (id, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+/**
+ * Copies from / to the ring, which may wrap
+ */
+static void ring_put (size_t pos, const void *src, size_t len)
+{
+    size_t off = pos % CAPTURE_RING;
+    size_t n   = (len < CAPTURE_RING - off) ? len : CAPTURE_RING - off;
+
+    memcpy (ring + off, src, n);
+    memcpy (ring, (const unsigned char *)src + n, len - n);
+}
+
+static void ring_get (size_t pos, void *dst, size_t len)
+{
+    size_t off = pos % CAPTURE_RING;
+    size_t n   = (len < CAPTURE_RING - off) ? len : CAPTURE_RING - off;
+
+    memcpy (dst, ring + off, n);
+    memcpy ((unsigned char *)dst + n, ring, len - n);
+}
+
+
+/**
+ * Opens the file; when rotating, the old one is renamed first and kept
+ * open until the new one is there. If that fails, the old file is
+ * continued without rotating any more.
+ *
+ * @return 0 on success
+ */
+static int capture_file (void)
+{
+    char    old[PATH_MAX];
+    FILE    *new;
+
+    if (fp)
+    {
+        snprintf (old, sizeof (old), "%s.%d", name, generation + 1);
+        if (rename (name, old) < 0)
+        {
+            fprintf (stderr, "\nCapture: renaming to \"%s\" failed: %s, not rotating!\n",
+                     old, strerror (errno));
+            rotate_size = 0;
+            return -1;
+        }
+    }
+
+    if ((new = fopen (name, "w")) == NULL)
+    {
+        fprintf (stderr, "\nCapture \"%s\" open failed: %s%s!\n", name, strerror (errno),
+                 fp ? ", not rotating" : "");
+        if (fp)
+        {
+            rename (old, name);
+            rotate_size = 0;
+        }
+        return -1;
+    }
+
+    if (fp)
+    {
+        fclose (fp);
+        generation++;
+    }
+    fp = new;
+    setvbuf (fp, NULL, _IOFBF, 1 << 16);
+    written = 0;
+    return 0;
+}
+
+
+/**
+ * Writes a time stamp
+ */
+static void write_stamp (const chunk_t *c)
+{
+    struct tm   tm;
+    time_t      sec = c->real / 1000000ULL;
+    char        date[32];
+
+    localtime_r (&sec, &tm);
+    strftime (date, sizeof (date), "%Y-%m-%d %H:%M:%S", &tm);
+    written += fprintf (fp, "%llu.%06llu %s.%06llu", c->mono / 1000000ULL, c->mono % 1000000ULL,
+                        date, c->real % 1000000ULL);
+}
+
+
+/**
+ * Writes a chunk: in raw mode with a header, otherwise every line
+ * with the stamp of the chunk it starts in
+ */
+static void write_chunk (const chunk_t *c, const char *data)
+{
+    const char  *end = data + c->len;
+    const char  *nl;
+
+    if (c->mark)
+    {
+        // a line of its own, also in raw mode
+        if (!raw_mode && !line_start)
+            written += fprintf (fp, "\n");
+        if (raw_mode)
+            fputc ('@', fp);
+        write_stamp (c);
+        written += fprintf (fp, " # %.*s\n", (int)c->len, data) + raw_mode;
+        line_start = TRUE;
+        return;
+    }
+
+    if (raw_mode)
+    {
+        fputc ('@', fp);
+        write_stamp (c);
+        written += fprintf (fp, " %lu\n", (unsigned long)c->len) + 1;
+        written += fwrite (data, 1, c->len, fp);
+        return;
+    }
+
+    while (data < end)
+    {
+        if (line_start)
+        {
+            write_stamp (c);
+            fputc (' ', fp);
+            written++;
+            line_start = FALSE;
+        }
+        nl = memchr (data, '\n', end - data);
+        if (nl == NULL)
+            nl = end - 1;
+        else
+            line_start = TRUE;
+
+        written += fwrite (data, 1, nl + 1 - data, fp);
+        data = nl + 1;
+
+        // rotate between lines only
+        if (line_start && rotate_size && (written >= rotate_size))
+            capture_file ();
+    }
+}
+
+
+/**
+ * Writes the chunks of the ring until capture_close
+ */
+static void * capture_thread (void *arg)
+{
+    char                *data = malloc (CAPTURE_RING);
+    unsigned long long  lost = 0;
+    unsigned long long  now_dropped;
+    struct timespec     next;
+    chunk_t             c;
+    size_t              pos;
+    size_t              end;
+    int                 stop = FALSE;
+
+    while (!stop)
+    {
+        pthread_mutex_lock (&lock);
+        if (running && (head == tail))
+        {
+            clock_gettime (CLOCK_MONOTONIC, &next);
+            next.tv_nsec += FLUSH_NS;
+            if (next.tv_nsec >= 1000000000L)
+            {
+                next.tv_sec++;
+                next.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait (&wake, &lock, &next);
+        }
+        stop = !running;
+        pos  = tail;
+        end  = head;
+        now_dropped = dropped;
+        pthread_mutex_unlock (&lock);
+
+        // the ring between tail and head is not touched by capture_data
+        while (pos != end)
+        {
+            ring_get (pos, &c, sizeof (c));
+            pos += sizeof (c);
+            if (data)
+            {
+                ring_get (pos, data, c.len);
+                write_chunk (&c, data);
+            }
+            pos += c.len;
+        }
+
+        // after the data queued before, written without the lock: capture_data
+        // never waits for the file
+        if (now_dropped != lost)
+        {
+            char note[80];
+
+            c.mono = clock_us (CLOCK_MONOTONIC);
+            c.real = clock_us (CLOCK_REALTIME);
+            c.len  = snprintf (note, sizeof (note), "capture: %llu bytes dropped, the disk is too slow",
+                               now_dropped - lost);
+            c.mark = TRUE;
+            write_chunk (&c, note);
+            lost = now_dropped;
+        }
+        fflush (fp);
+
+        pthread_mutex_lock (&lock);
+        tail = pos;
+        pthread_mutex_unlock (&lock);
+
+        if (raw_mode && rotate_size && (written >= rotate_size))
+            capture_file ();
+    }
+    free (data);
+
+    return NULL;
+}
+
+
+/**
+ * Starts capturing to filename
+ */
+int capture_open (const char            *filename,
+                  int                   raw,
+                  unsigned long long    rotate)
+{
+    pthread_condattr_t attr;
+
+    name        = filename;
+    raw_mode    = raw;
+    rotate_size = rotate;
+
+    if ((ring = malloc (CAPTURE_RING)) == NULL)
+    {
+        fprintf (stderr, "Memory allocation error, could not get %d bytes for the capture!\n",
+                 CAPTURE_RING);
+        return -1;
+    }
+    if (capture_file () < 0)
+    {
+        free (ring);
+        ring = NULL;
+        return -1;
+    }
+
+    pthread_condattr_init (&attr);
+    pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+    pthread_cond_init (&wake, &attr);
+    pthread_condattr_destroy (&attr);
+
+    running = TRUE;
+    if (pthread_create (&thread, NULL, capture_thread, NULL) != 0)
+    {
+        running = FALSE;
+        fclose (fp);
+        fp = NULL;
+        free (ring);
+        ring = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Stamps and queues data or a marker
+ */
+static void capture_chunk (const char   *buf,
+                           size_t       len,
+                           int          mark)
+{
+    chunk_t c;
+
+    if (!ring || (len == 0))
+        return;
+
+    c.mono = clock_us (CLOCK_MONOTONIC);
+    c.real = clock_us (CLOCK_REALTIME);
+    c.len  = len;
+    c.mark = mark;
+
+    pthread_mutex_lock (&lock);
+    if (CAPTURE_RING - (head - tail) < sizeof (c) + len)
+        dropped += len;
+    else
+    {
+        ring_put (head, &c, sizeof (c));
+        ring_put (head + sizeof (c), buf, len);
+        head += sizeof (c) + len;
+        pthread_cond_signal (&wake);
+    }
+    pthread_mutex_unlock (&lock);
+}
+
+
+/**
+ * Stamps and queues received data
+ */
+void capture_data (const char   *buf,
+                   size_t       len)
+{
+    capture_chunk (buf, len, FALSE);
+}
+
+
+/**
+ * Queues a marker line
+ */
+void capture_marker (const char *text)
+{
+    capture_chunk (text, strlen (text), TRUE);
+}
+
+
+/**
+ * Writes what is queued and stops capturing
+ */
+void capture_close (void)
+{
+    if (!ring)
+        return;
+
+    pthread_mutex_lock (&lock);
+    running = FALSE;
+    pthread_cond_signal (&wake);
+    pthread_mutex_unlock (&lock);
+    pthread_join (thread, NULL);
+
+    if (fclose (fp) != 0)
+        fprintf (stderr, "Writing capture \"%s\" failed: %s!\n", name, strerror (errno));
+    fp = NULL;
+    free (ring);
+    ring = NULL;
+}
+
+/* end of file */
@@ -0,0 +1,58 @@
+/**
+ * Capture of the terminal mode for the bootloader of Peter Dannegger
+ *
+ * The received data is stamped with CLOCK_MONOTONIC and the real time
+ * when it is read and copied into a ring buffer; a thread writes it to
+ * the file, so a slow disk never holds up the serial line. If the ring
+ * is full, data is dropped and the gap is noted in the file as a marker.
+ *
+ * Lines:  <monotonic s.us> <YYYY-mm-dd HH:MM:SS.us> <line as received>
+ * Raw:    @<monotonic s.us> <YYYY-mm-dd HH:MM:SS.us> <len>\n<len bytes>
+ * Marker: [@]<monotonic s.us> <YYYY-mm-dd HH:MM:SS.us> # <text>
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+#ifndef CAPTURE_H_INCLUDED
+#define CAPTURE_H_INCLUDED
+
+#include <stddef.h>
+
+
+// size of the ring buffer
+#define CAPTURE_RING    (4 * 1024 * 1024)
+
+
+/// Prototypes
+
+/**
+ * Starts capturing to filename; raw writes every chunk with a header
+ * instead of stamping lines. With rotate > 0 the file is renamed to
+ * filename.1, .2, ... when it exceeds rotate bytes.
+ *
+ * @return 0 on success
+ */
+int capture_open (const char            *filename,
+                  int                   raw,
+                  unsigned long long    rotate);
+
+/**
+ * Stamps and queues received data, never blocks on the file
+ */
+void capture_data (const char   *buf,
+                   size_t       len);
+
+/**
+ * Queues a marker, written as a line of its own (a line of the
+ * received data is broken there)
+ */
+void capture_marker (const char *text);
+
+/**
+ * Writes what is queued and stops capturing
+ */
+void capture_close (void);
+
+#endif //CAPTURE_H_INCLUDED
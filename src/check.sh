@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+# Programs and verifies through fbootemu, with and without its faults
+#
+# Every case starts the emulator on a pty, runs the bootloader against
+# it and checks the exit code and a line of the output. Run by
+# 'make check' after the build.
+#
+# License: GPL
+#
+# @author Bernhard Michler
+
+BL=./bootloader
+EMU=./fbootemu
+SIG=1e950f
+
+dir=`mktemp -d /tmp/fbootcheck.XXXXXX` || exit 2
+tty=$dir/tty
+hex=$dir/image.hex
+fbw=$dir/image.fbw
+log=$dir/log
+emu_pid=
+failed=0
+passed=0
+
+cleanup ()
+{
+    [ -n "$emu_pid" ] && kill $emu_pid 2>/dev/null
+    rm -rf $dir
+}
+trap cleanup EXIT
+trap 'exit 2' INT TERM
+
+# 6000 bytes with every 8th one to be escaped (0xA5, 0x13)
+awk 'BEGIN {
+    srand (1);
+    for (addr = 0; addr < 6000; addr += 16)
+    {
+        line = sprintf ("%02X%04X00", 16, addr);
+        sum = 16 + int (addr / 256) + addr % 256;
+        for (i = 0; i < 16; i++)
+        {
+            if ((addr + i) % 16 == 3)       b = 165;
+            else if ((addr + i) % 16 == 11) b = 19;
+            else                            b = int (rand () * 256);
+            line = line sprintf ("%02X", b);
+            sum += b;
+        }
+        printf (":%s%02X\n", line, (256 - sum % 256) % 256);
+    }
+    print ":00000001FF";
+}' > $hex
+
+emu_start ()
+{
+    rm -f $tty
+    $EMU -l $tty -s $SIG "$@" > $dir/emu.log 2>&1 &
+    emu_pid=$!
+    n=0
+    while [ ! -e $tty ] && [ $n -lt 50 ]
+    do
+        sleep 0.1
+        n=`expr $n + 1`
+    done
+}
+
+emu_stop ()
+{
+    kill $emu_pid 2>/dev/null
+    wait $emu_pid 2>/dev/null
+    emu_pid=
+}
+
+# check name "emulator options" "bootloader options" exit-code text
+check ()
+{
+    emu_start $2
+    timeout 120 $BL -d $tty -r $3 > $log 2>&1
+    ret=$?
+    emu_stop
+
+    if [ $ret -eq $4 ] && grep -q -- "$5" $log
+    then
+        echo "ok    $1"
+        passed=`expr $passed + 1`
+    else
+        echo "FAIL  $1 (exit $ret, expected $4 and \"$5\")"
+        sed 's/^/      /' $log | tail -20
+        failed=`expr $failed + 1`
+    fi
+}
+
+ok="successfully verified"
+
+check "program, verify"     ""              "-p -v $hex"                0 "$ok"
+check "wire time of host"   "-b host"       "-b 115200 -p -v $hex"      0 "$ok"
+check "one-wire"            "-1"            "-1 -p -v $hex"             0 "$ok"
+check "slow CONTINUE"       "-L 50/2"       "-p -v $hex"                0 "$ok"
+check "autobaud ladder"     "-b host -M 100000" "-b 230400,57600 -p $hex" 0 "Baudrate used : 57600"
+check "CRC check fails"     "-c 3"          "-p $hex"                   6 "Programming failed (wrong CRC)"
+check "no reset, no ladder" "-c 3"          "-b 115200,57600 -p $hex"   6 "Stepping down : not possible"
+check "bytes dropped"       "-x 0.01"       "-p $hex"                   5 "Programming failed"
+check "disconnect"          "-X 3000"       "-p $hex"                   5 "Device disconnected"
+check "if changed"          "-b host"       "-b 115200 --if-changed -p $hex" 0 "Image differs"
+check "no VERIFY"           "-V 0"          "--if-changed -p $hex"      0 "successfully programmed"
+check "no VERIFY, late"     "-V 300"        "--if-changed -p $hex"      0 "successfully programmed"
+
+if $BL --compile $hex -o $fbw --signature $SIG --buffsize 960 > $log 2>&1
+then
+    check "bundle"          ""              "-p -v $fbw"                0 "$ok"
+else
+    echo "FAIL  compile bundle"
+    failed=`expr $failed + 1`
+fi
+
+echo "$passed passed, $failed failed"
+[ $failed -eq 0 ]
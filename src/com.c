@@ -13,10 +13,11 @@
 #include <time.h>
 #include <errno.h>
 #include <string.h>
-#include <sys/times.h>
-#include <sys/ioctl.h>
+#include <poll.h>
+#include <stdlib.h>
 
 #include "com.h"
+#include "com_baud.h"
 #include "protocol.h"
 
 
@@ -55,6 +56,12 @@ static baudInfo_t baudrates[] = {
 struct termios oldtio;
 // CRC checksum
 unsigned int crc = 0;
+// sent data is added to crc, off while a precomputed CRC is used
+static int crc_calc = 1;
+
+// CRC table, 0xA001 polynom
+static unsigned short crc_table[256];
+static int            crc_table_ok = 0;
 
 int sendCount = 0;
 
@@ -63,8 +70,36 @@ int waitcount = 0;
 // time in usec neded for transferring one byte
 static long bytetime;
 
+// time in usec one byte needs on the line
+static long linetime;
+
+// byte times to wait instead of tcdrain, 0: use tcdrain
+static int  waitbytes = 0;
+
+// keep the output queue filled instead of draining it after each block
+static int  streaming = 1;
+
+// output queue watermarks in bytes, see com_pace
+#define OUTQ_TIME   30000   // usec of line time to keep queued
+#define OUTQ_MIN    64
+
+// time in msec the output queue may stay full
+#define TXTIMEOUT   5000
+
+// transmit buffer, collects the bytes of one block for a single write
+static unsigned long long txtotal = 0;   // bytes written to the device
+static unsigned char txbuf[TXBUF_MAX];
+static size_t        txlen = 0;
+static size_t        txblock = 16;
+
+// receive buffer (ring), filled by poll/read in bigger chunks
+static unsigned char rxbuf[RXBUF_SIZE];
+static size_t        rxhead = 0;
+static size_t        rxtail = 0;
+
 /// Prototypes
 void calc_crc(unsigned char d);
+static int com_fill (int fd, int timeout);
 
 
 /**
@@ -88,23 +123,23 @@ speed_t get_baudid (unsigned long baud)
 }
 
 /**
- * Get the time needed for transferring one byte 8N1 from baud-id, return 0 if invalid
+ * Checks if a baudrate can be used: from the table or, where the
+ * system allows it, any other rate
  */
-long get_bytetime (speed_t baudid)
+int com_baud_ok (unsigned long baud)
 {
-    int i;
-    long btime = 0;
+    return (get_baudid (baud) != B0) || com_custom_baud_ok (baud);
+}
 
-    for(i = 0; i < (sizeof (baudrates) / sizeof (baudInfo_t)); i++)
-    {
-        if (baudrates[i].constval == baudid)
-        {
-            btime = (1000000L * 10L / baudrates[i].value) + 1;
-            break;
-        }
-    }
+/**
+ * Get the time needed for transferring one byte 8N1 from baudrate, return 0 if invalid
+ */
+static long get_bytetime (unsigned long baud)
+{
+    if (baud == 0)
+        return 0;
 
-    return (btime);
+    return (1000000L * 10L / baud) + 1;
 }
 
 /**
@@ -116,6 +151,27 @@ void com_localecho ()
     sendCount = 1;
 }
 
+/**
+ * Checks if the own bytes are echoed (one-wire)
+ */
+int com_is_localecho (void)
+{
+    return sendCount != 0;
+}
+
+/**
+ * Set number of bytes collected in the transmit buffer before
+ * they are written to the device
+ */
+void com_blocksize (int size)
+{
+    if (size < 1)
+        size = 1;
+    if (size > TXBUF_MAX)
+        size = TXBUF_MAX;
+    txblock = size;
+}
+
 
 /**
  * Get status of device. It might happen that the device disappears (e.g.
@@ -138,9 +194,10 @@ int get_device_status(int fd)
  *
  * @return true if successfull
  */
-int com_open (const char * device, speed_t baud, int wait_bytetime)
+int com_open (const char * device, unsigned long baud, int wait_bytetime)
 {
     struct termios newtio;
+    speed_t baudid = get_baudid (baud);
     int fd;
 
     // Open the device
@@ -169,9 +226,12 @@ int com_open (const char * device, speed_t baud, int wait_bytetime)
     // read 1 character
     newtio.c_cc[VMIN] = 0;
 
-    // Setting baudrate
-    cfsetispeed(&newtio, baud);
-    cfsetospeed(&newtio, baud);
+    // Setting baudrate, other rates are set by com_set_baud
+    // (B0 would hang up)
+    if (baudid == B0)
+        baudid = B9600;
+    cfsetispeed(&newtio, baudid);
+    cfsetospeed(&newtio, baudid);
 
     // Flushing buffer
     tcflush(fd, TCIOFLUSH);
@@ -180,20 +240,81 @@ int com_open (const char * device, speed_t baud, int wait_bytetime)
     tcsetattr(fd, TCSANOW, &newtio);
 
     sendCount = 0;
+    txlen = 0;
+    rxhead = rxtail = 0;
+
+    waitbytes = wait_bytetime;
+
+    // the rate can't be set (e.g. BOTHER not supported): don't run at 9600
+    if (com_set_baud (fd, baud) < 0)
+    {
+        int err = errno;
+
+        tcsetattr (fd, TCSANOW, &oldtio);
+        close (fd);
+        errno = err;
+        return COM_NO_BAUD;
+    }
 
-    if (wait_bytetime)
+    return fd;
+}
+
+/**
+ * Changes the baudrate of the open com port
+ *
+ * @return 0 if successfull
+ */
+int com_set_baud (int fd, unsigned long baud)
+{
+    struct termios tio;
+    speed_t baudid = get_baudid (baud);
+
+    // nothing may be left in the queues at the old rate
+    com_drain (fd);
+
+    if (baudid != B0)
+    {
+        // standard rate
+        if (tcgetattr (fd, &tio) < 0)
+            return -1;
+
+        cfsetispeed(&tio, baudid);
+        cfsetospeed(&tio, baudid);
+        if (tcsetattr (fd, TCSANOW, &tio) < 0)
+            return -1;
+    }
+    else if (com_set_custom_baud (fd, baud) < 0)
+    {
+        return -1;
+    }
+
+    tcflush (fd, TCIFLUSH);
+    rxhead = rxtail = 0;
+
+    linetime = get_bytetime (baud);
+    com_wait_bytetime (waitbytes);
+
+    return 0;
+}
+
+/**
+ * Wait n byte times after a block instead of tcdrain, 0: use tcdrain
+ */
+void com_wait_bytetime (int n)
+{
+    waitbytes = n;
+
+    if (waitbytes)
     {
         // do not use tcdrain, instead wait the time...
         // time in usec needed for transferring one byte
         // multiplied by the number of bytetimes that should be waited
-        bytetime = get_bytetime (baud) * wait_bytetime;
+        bytetime = linetime * waitbytes;
     }
     else
     {
         bytetime = 0;
     }
-
-    return fd;
 }
 
 /**
@@ -250,11 +371,149 @@ void com_toggle_dtr(int fd)
 }
 
 
+/**
+ * Skip the echo of sent bytes in one-wire mode, as far as it is
+ * already received
+ */
+static void com_skip_echo (int fd)
+{
+    if (rxhead == rxtail)
+        com_fill(fd, 0);
+
+    while ((sendCount > 1) && (rxhead != rxtail))
+    {
+        rxtail++;
+        sendCount--;
+    }
+}
+
+/**
+ * Write a buffer to the device; if the output queue of the driver
+ * is full wait until there is space again
+ *
+ * @return 0 on success, COM_DISCONNECT if the device is gone
+ */
+static int com_write_all (int                 fd,
+                          const unsigned char *p,
+                          size_t              len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = write(fd, p, len);
+        if (n > 0)
+        {
+            txtotal += n;
+            p   += n;
+            len -= n;
+        }
+        else if ((n < 0) && (errno == EAGAIN))
+        {
+            struct pollfd pfd;
+
+            pfd.fd      = fd;
+            pfd.events  = POLLOUT;
+            pfd.revents = 0;
+
+            n = poll(&pfd, 1, TXTIMEOUT);
+            if ((n == 0) || ((n < 0) && (errno != EINTR)))
+                return COM_DISCONNECT;
+            if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+                return COM_DISCONNECT;
+        }
+        else if ((n < 0) && (errno != EINTR))
+        {
+            return COM_DISCONNECT;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write the transmit buffer to the device
+ *
+ * @return 0 on success, COM_DISCONNECT if the device is gone
+ */
+int com_flush (int fd)
+{
+    int ret;
+
+    if (crc_calc)
+        calc_crc_buf (txbuf, txlen); // calculate transmit CRC
+
+    // if the device disappeared, forget the rest
+    ret = com_write_all(fd, txbuf, txlen);
+    txlen = 0;
+
+    if (sendCount > 1)
+        com_skip_echo(fd);
+
+    return ret;
+}
+
+/**
+ * Sends a buffer without copying it into the transmit buffer. When
+ * streaming, it is handed to the driver as a whole, otherwise in
+ * blocks of the set blocksize.
+ *
+ * @return 0 on success, COM_DISCONNECT if the device is gone
+ */
+int com_write (int                 fd,
+               const unsigned char *buf,
+               size_t              len)
+{
+    size_t  n;
+    int     ret;
+
+    ret = com_flush(fd);
+
+    if (streaming && !bytetime && !sendCount)
+    {
+        if (crc_calc)
+            calc_crc_buf(buf, len);
+        waitcount += len;
+        return (ret < 0) ? ret : com_write_all(fd, buf, len);
+    }
+
+    // one-wire echo has to be read after each block
+    while ((len > 0) && (ret == 0))
+    {
+        n = (len > txblock) ? txblock : len;
+
+        if (crc_calc)
+            calc_crc_buf(buf, n);
+        waitcount += n;
+        if (sendCount)
+            sendCount += n;
+
+        ret = com_write_all(fd, buf, n);
+        if (sendCount > 1)
+            com_skip_echo(fd);
+
+        buf += n;
+        len -= n;
+        if (len > 0)
+            com_pace(fd);
+    }
+    return ret;
+}
+
+/**
+ * Switches the CRC calculation of sent data on or off
+ */
+void com_crc_calc (int on)
+{
+    crc_calc = on;
+}
+
 /**
  * Make sure all is written out....
  */
 void com_drain (int fd)
 {
+    com_flush(fd);
+
     if (bytetime)
     {
         usleep (bytetime * waitcount);
@@ -266,6 +525,70 @@ void com_drain (int fd)
     }
 }
 
+/**
+ * Discards everything not yet written out
+ */
+void com_discard (int fd)
+{
+    txlen = 0;
+    waitcount = 0;
+    tcflush(fd, TCOFLUSH);
+}
+
+/**
+ * Switch streaming of blocks on or off; when off every block is
+ * drained before the next one is sent
+ */
+void com_streaming (int on)
+{
+    streaming = on;
+}
+
+/**
+ * Keep the line busy between two blocks: the output queue of the driver
+ * is refilled as long as it holds less than the high watermark (about
+ * OUTQ_TIME of line time), otherwise we sleep until it is down to the low
+ * watermark. Falls back to com_drain if the queue size is not available
+ * or waiting is done by byte time.
+ */
+void com_pace (int fd)
+{
+    static int outq_ok = 1;
+    int     queued;
+    int     high;
+    int     low;
+
+    if (bytetime || !streaming || !outq_ok || !linetime)
+    {
+        com_drain(fd);
+        return;
+    }
+
+    com_flush(fd);
+
+    high = OUTQ_TIME / linetime;
+    if (high < 2 * (int)txblock)
+        high = 2 * txblock;
+    if (high < OUTQ_MIN)
+        high = OUTQ_MIN;
+    low = high / 2;
+
+    while (1)
+    {
+        if (ioctl(fd, TIOCOUTQ, &queued) < 0)
+        {
+            outq_ok = 0;
+            com_drain(fd);
+            break;
+        }
+        if (queued <= high)
+            break;
+
+        usleep((queued - low) * linetime);
+    }
+    waitcount = 0;
+}
+
 /**
  * Close com port and restore settings
  */
@@ -281,39 +604,164 @@ void com_close(int fd)
 }
 
 /**
- * Receives one char or -1 if timeout
- * timeout in 10th of seconds
+ * Number of bytes written to the device so far
  */
-int com_getc(int fd,
-             int timeout)
+unsigned long long com_tx_count (void)
 {
-    static long         ticks = 0;
-    static struct tms   theTimes;
-    char    c;
-    clock_t t = times (&theTimes);
+    return txtotal;
+}
+
+/**
+ * Get a monotonic timestamp in usec
+ */
+unsigned long long get_time_us (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    if (ticks == 0)
-        ticks = sysconf(_SC_CLK_TCK) / 10;
+    return ((unsigned long long)ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+/**
+ * Wait up to timeout msec for input and read it into the receive buffer
+ *
+ * @return number of bytes read, 0 on timeout, COM_DISCONNECT if the
+ *         device is gone
+ */
+static int com_fill (int fd,
+                     int timeout)
+{
+    struct pollfd pfd;
+    size_t  head;
+    size_t  len;
+    ssize_t n;
+    int     ret;
+
+    pfd.fd      = fd;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+
+    ret = poll(&pfd, 1, timeout);
+    if (ret < 0)
+    {
+        return (errno == EINTR) ? 0 : COM_DISCONNECT;
+    }
+    if (ret == 0)
+    {
+        return 0;
+    }
 
-    do
+    if (pfd.revents & POLLIN)
     {
-        if (!get_device_status(fd))
+        // read into the free space up to the end of the ring
+        head = rxhead & (RXBUF_SIZE - 1);
+        len  = RXBUF_SIZE - (rxhead - rxtail);
+        if (len > RXBUF_SIZE - head)
+            len = RXBUF_SIZE - head;
+        if (len == 0)
+            return 0;
+
+        n = read(fd, rxbuf + head, len);
+        if (n > 0)
         {
-            return COM_DISCONNECT;
+            rxhead += n;
+            return n;
+        }
+        if ((n < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+        {
+            return 0;
         }
-        if (read(fd, &c, 1) == 1)
+        // readable but no data: hangup
+        return COM_DISCONNECT;
+    }
+
+    if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+    {
+        return COM_DISCONNECT;
+    }
+
+    return 0;
+}
+
+/**
+ * Number of received bytes waiting in the receive buffer
+ */
+int com_rx_pending (void)
+{
+    return (int)(rxhead - rxtail);
+}
+
+/**
+ * Bytes in the output queue of the driver, -1 if unknown
+ */
+int com_outq (int fd)
+{
+    int queued;
+
+    if (ioctl(fd, TIOCOUTQ, &queued) < 0)
+        return -1;
+    return queued + (int)txlen;
+}
+
+/**
+ * Receives one char or -1 if timeout
+ * timeout in msec
+ */
+int com_getc_ms(int fd,
+                int timeout)
+{
+    unsigned long long  deadline;
+    long long           remain;
+    int                 ret;
+    unsigned char       c;
+
+    // the answer will not come before the command is sent
+    if (txlen > 0)
+        com_flush(fd);
+
+    deadline = get_time_us() + (unsigned long long)timeout * 1000ULL;
+
+    while (1)
+    {
+        while (rxhead != rxtail)
         {
+            c = rxbuf[rxtail++ & (RXBUF_SIZE - 1)];
+
             if (sendCount > 1)
             {
+                // own echo in one-wire mode, restart timeout
                 sendCount--;
-                t = times (&theTimes);
+                deadline = get_time_us() + (unsigned long long)timeout * 1000ULL;
                 continue;
             }
-            return (unsigned char)c;
+            return c;
         }
-    } while ( ((times (&theTimes) - t )/ticks) < timeout );
 
-    return COM_TIMEOUT;
+        remain = (long long)(deadline - get_time_us());
+        if (remain < 0)
+            remain = 0;
+
+        ret = com_fill(fd, (int)((remain + 999) / 1000));
+        if (ret == COM_DISCONNECT)
+        {
+            return COM_DISCONNECT;
+        }
+        if ((ret == 0) && (get_time_us() >= deadline))
+        {
+            return COM_TIMEOUT;
+        }
+    }
+}
+
+/**
+ * Receives one char or -1 if timeout
+ * timeout in 10th of seconds
+ */
+int com_getc(int fd,
+             int timeout)
+{
+    return com_getc_ms(fd, timeout * 100);
 }
 
 /*****************************************************************************
@@ -325,50 +773,61 @@ int com_read (int       fd,
               char      *pszIn,
               size_t    tLen)
 {
-    int iNrRead;
+    size_t  tail;
+    size_t  len;
+    int     iNrRead = 0;
 
-    do {
-        if (!get_device_status(fd))
+    if (rxhead == rxtail)
+    {
+        if (com_fill(fd, 0) == COM_DISCONNECT)
         {
             printf ("\nDevice disconnected!\n");
             return -1;
         }
+    }
 
-        iNrRead = read (fd, pszIn, tLen);
-#if 0
-        int flags;
-        /* Get the current line bits */
-        ioctl(fd, TIOCMGET, &flags);
-        printf("Flags are %o.\n", flags);
-#endif
-    } while ((iNrRead < 0) && (errno == EINTR));
+    // copy from the ring, may wrap once
+    while ((rxhead != rxtail) && (tLen > 0))
+    {
+        tail = rxtail & (RXBUF_SIZE - 1);
+        len  = rxhead - rxtail;
+        if (len > RXBUF_SIZE - tail)
+            len = RXBUF_SIZE - tail;
+        if (len > tLen)
+            len = tLen;
+
+        memcpy(pszIn, rxbuf + tail, len);
+        rxtail  += len;
+        pszIn   += len;
+        tLen    -= len;
+        iNrRead += len;
+    }
 
     return (iNrRead);
 }
 
 /**
- * Sends one char
+ * Sends one char; it is collected in the transmit buffer, which is
+ * written when the blocksize is reached
  */
 void com_putc_fast(int           fd,
                    unsigned char c)
 {
     if (sendCount)
-    {
-        if (sendCount > 1)
-            com_getc(fd, 0);
         sendCount++;
-    }
     waitcount++;
 
-    while ((write(fd, &c, 1) < 0) && (errno == EINTR));
+    txbuf[txlen++] = c;
 
-    calc_crc( c ); // calculate transmit CRC
+    if (txlen >= txblock)
+        com_flush(fd);
 }
 
 void com_putc(int fd, unsigned char c)
 {
     com_drain(fd);
     com_putc_fast (fd, c);
+    com_flush(fd);
 }
 
 
@@ -386,16 +845,180 @@ void sendcommand(int fd, unsigned char c)
 
 
 /**
- * Calculate the new CRC sum
+ * Calculate the new CRC sum, bit by bit (reference for the table)
  */
-void calc_crc(unsigned char d)
+static unsigned int calc_crc_bitwise (unsigned int  c,
+                                      unsigned char d)
 {
     int i;
 
-    crc ^= d;
+    c ^= d;
     for( i = 8; i; i-- )
     {
-        crc = (crc >> 1) ^ ((crc & 1) ? 0xA001 : 0 );
+        c = (c >> 1) ^ ((c & 1) ? 0xA001 : 0 );
+    }
+    return c;
+}
+
+/**
+ * Fill the CRC table, one entry for each value of the low byte
+ */
+static void crc_init_table (void)
+{
+    int i;
+
+    for (i = 0; i < 256; i++)
+    {
+        crc_table[i] = calc_crc_bitwise (0, i);
     }
+    crc_table_ok = 1;
+}
+
+/**
+ * Calculate the new CRC sum
+ */
+void calc_crc(unsigned char d)
+{
+    if (!crc_table_ok)
+        crc_init_table ();
+
+    crc = (crc >> 8) ^ crc_table[(crc ^ d) & 0xFF];
 }
 
+/**
+ * Calculate the new CRC sum over a buffer
+ */
+void calc_crc_buf(const uint8_t *buf,
+                  size_t        len)
+{
+    unsigned int c = crc;
+
+    if (!crc_table_ok)
+        crc_init_table ();
+
+    while (len--)
+    {
+        c = (c >> 8) ^ crc_table[(c ^ *buf++) & 0xFF];
+    }
+    crc = c;
+}
+
+/**
+ * Check the table driven CRC against the bitwise calculation
+ *
+ * @return 0 if ok, number of errors otherwise
+ */
+int crc_selftest (void)
+{
+    static const uint8_t check[] = "123456789";
+    uint8_t      buf[1024];
+    unsigned int c, ref;
+    unsigned int saved = crc;
+    int          errors = 0;
+    size_t       i, len;
+
+    // every CRC value with every byte
+    for (c = 0; c < 0x10000; c++)
+    {
+        for (i = 0; i < 256; i++)
+        {
+            crc = c;
+            calc_crc (i);
+            if (crc != calc_crc_bitwise (c, i))
+                errors++;
+        }
+    }
+
+    // buffers of all lengths, including the 0xA5/0x13 escape chars
+    srand (1);
+    for (i = 0; i < sizeof (buf); i++)
+        buf[i] = (i & 7) ? rand () : ((i & 8) ? ESCAPE : 0x13);
+
+    for (len = 0; len <= sizeof (buf); len += (len < 64) ? 1 : 61)
+    {
+        ref = 0xFFFF & (len * 0x9E37);
+        crc = ref;
+        for (i = 0; i < len; i++)
+            ref = calc_crc_bitwise (ref, buf[i]);
+        calc_crc_buf (buf, len);
+        if (crc != ref)
+            errors++;
+    }
+
+    // check value of CRC-16/ARC; appending the CRC gives 0
+    crc = 0;
+    calc_crc_buf (check, 9);
+    if (crc != 0xBB3D)
+        errors++;
+    calc_crc (0x3D);
+    calc_crc (0xBB);
+    if (crc != 0)
+        errors++;
+
+    crc = saved;
+    return errors;
+}
+
+
+/**
+ * Reads a value from bootloader, timeout in 100ms
+ *
+ * @return value; -2 on error, -3 on timeout, -4 if disconnected
+ */
+long readval(int fd,
+             int timeout)
+{
+    int i;
+    int j = 257;
+    long val = 0;
+
+    while(1)
+    {
+        i = com_getc (fd, timeout);
+        if (i == COM_TIMEOUT)
+        {
+            printf("readval: ...Device does not answer!\n");
+            return -3;
+        }
+        else if (i == COM_DISCONNECT)
+        {
+            printf("readval: ...Device disconnected!\n");
+            return -4;
+        }
+
+        switch(j)
+        {
+            case 1:
+                if(i == SUCCESS)
+                {
+                    return val;
+                }
+                break;
+
+            case 2:
+            case 3:
+            case 4:
+                val = val * 256 + i;
+                j--;
+                break;
+
+            case 256:
+                j = i;
+                break;
+
+            case 257:
+                if(i == FAIL) {
+                    return -2;
+                }
+                else if(i == ANSWER) {
+                    j = 256;
+                }
+                break;
+
+            default:
+                printf("\nError: readval, i = %i, j = %i, val = %li\n", i, j, val);
+                return -2;
+        }
+    }
+    return -1;
+}
@@ -10,12 +10,19 @@
 #define COM_H_INCLUDED
 
 #include <fcntl.h>
+#include <stdint.h>
 #include <termios.h>
 #include <unistd.h>
 
 
 #define COM_TIMEOUT     -1
 #define COM_DISCONNECT  -2
+#define COM_NO_BAUD     -3      // com_open: the rate can't be set
+
+// maximum size of one block written to the device
+#define TXBUF_MAX       4096
+// size of the receive buffer, must be a power of 2
+#define RXBUF_SIZE      8192
 
 extern unsigned int crc;
 
@@ -27,12 +34,30 @@ extern unsigned int crc;
  */
 void com_localecho ();
 
+/**
+ * Checks if the own bytes are echoed (one-wire)
+ */
+int com_is_localecho (void);
+
+/**
+ * Set number of bytes collected before they are written as one block
+ */
+void com_blocksize (int size);
+
 /**
  * Opens com port
  *
- * @return descriptor
+ * @return descriptor, negative on error (COM_NO_BAUD if the rate can't
+ *         be set, errno is set as well)
+ */
+int com_open(const char * device, unsigned long baud, int wait_bytetime);
+
+/**
+ * Changes the baudrate of the open com port
+ *
+ * @return 0 if successfull
  */
-int com_open(const char * device, speed_t baud, int use_drain);
+int com_set_baud (int fd, unsigned long baud);
 
 /**
  * Close com port and restore settings
@@ -46,10 +71,68 @@ void com_putc_fast(int fd, unsigned char c);
 void com_putc(int fd, unsigned char c);
 
 /**
- * Receives one char or -1 if timeout
+ * Writes the collected chars to the device
+ */
+int com_flush(int fd);
+
+/**
+ * Sends a buffer of chars
+ */
+int com_write(int fd, const unsigned char *buf, size_t len);
+
+/**
+ * Waits until all chars are written out
+ */
+void com_drain(int fd);
+
+/**
+ * Discards everything not yet written out
+ */
+void com_discard(int fd);
+
+/**
+ * Keeps the output queue of the driver filled between two blocks
+ */
+void com_pace(int fd);
+
+/**
+ * Wait n byte times after a block instead of tcdrain, 0: use tcdrain
+ */
+void com_wait_bytetime (int n);
+
+/**
+ * Switch streaming of blocks (com_pace) on or off
+ */
+void com_streaming(int on);
+
+/**
+ * Receives one char or -1 if timeout (in 10th of seconds)
  */
 int com_getc(int fd, int timeout);
 
+/**
+ * Receives one char or -1 if timeout (in msec)
+ */
+int com_getc_ms(int fd, int timeout);
+
+/**
+ * Reads a value from bootloader (ANSWER, length, value, SUCCESS),
+ * timeout in 10th of seconds
+ *
+ * @return value; -2 on error, -3 on timeout, -4 if disconnected
+ */
+long readval(int fd, int timeout);
+
+/**
+ * Number of received bytes not yet read
+ */
+int com_rx_pending (void);
+
+/**
+ * Bytes in the output queue of the driver, -1 if unknown
+ */
+int com_outq (int fd);
+
 /**
  * Read input string
  */
@@ -67,6 +150,12 @@ void sendcommand(int fd, unsigned char c);
  */
 speed_t get_baudid (unsigned long baud);
 
+/**
+ * Checks if a baudrate can be used: from the table or, where the
+ * system allows it, any other rate
+ */
+int com_baud_ok (unsigned long baud);
+
 /**
  * Sets the DTR (Data Terminal Ready) on the com port
  */
@@ -77,8 +166,34 @@ void com_set_dtr(int fd, unsigned char on);
  */
 void com_toggle_dtr(int fd);
 
+/**
+ * Updates the CRC with one byte / a buffer (polynom 0xA001)
+ */
 void calc_crc(unsigned char d);
 
+/**
+ * Switches the CRC calculation of the sent data off while a
+ * precomputed CRC of the transfer is used, and on again
+ */
+void com_crc_calc (int on);
+
+void calc_crc_buf(const uint8_t *buf, size_t len);
+
+/**
+ * Checks the CRC table against the bitwise algorithm, 0 if ok
+ */
+int crc_selftest (void);
+
+/**
+ * Monotonic time in usec
+ */
+unsigned long long get_time_us (void);
+
+/**
+ * Number of bytes written to the device so far
+ */
+unsigned long long com_tx_count (void);
+
 int get_device_status(int fd);
 
 #endif //COM_H_INCLUDED
@@ -0,0 +1,93 @@
+/**
+ * Arbitrary baudrates for the com port
+ *
+ * The Bxxx constants of termios only know the standard rates; Linux
+ * takes any integer rate through termios2 and BOTHER. asm/termbits.h
+ * conflicts with termios.h, so this has its own translation unit.
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+
+/// Includes
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#else
+#include <termios.h>
+#endif
+
+#include "com_baud.h"
+
+
+/**
+ * Checks if a baudrate which is not in the table can be set
+ */
+int com_custom_baud_ok (unsigned long baud)
+{
+#if defined(__linux__) && defined(BOTHER)
+    return (baud > 0) && (baud <= 0xffffffffUL);
+#else
+    return 0;
+#endif
+}
+
+
+/**
+ * Sets an arbitrary baudrate on the open com port
+ *
+ * @return 0 if successfull
+ */
+int com_set_custom_baud (int            fd,
+                         unsigned long  baud)
+{
+#if defined(__linux__) && defined(BOTHER)
+    struct termios2 tio;
+
+    if (ioctl (fd, TCGETS2, &tio) < 0)
+        return -1;
+
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    tio.c_ispeed = baud;
+    tio.c_ospeed = baud;
+
+    return ioctl (fd, TCSETS2, &tio);
+#else
+    errno = EINVAL;
+    return -1;
+#endif
+}
+
+
+/**
+ * Reads the output baudrate of the open com port, standard or not
+ *
+ * @return the baudrate, 0 on error
+ */
+unsigned long com_get_baud (int fd)
+{
+#ifdef __linux__
+    struct termios2 tio;
+
+    // the kernel fills in the rate for the Bxxx constants as well
+    if (ioctl (fd, TCGETS2, &tio) < 0)
+        return 0;
+
+    return tio.c_ospeed;
+#else
+    struct termios tio;
+
+    // speed_t of the BSDs is the rate itself
+    if (tcgetattr (fd, &tio) < 0)
+        return 0;
+
+    return cfgetospeed (&tio);
+#endif
+}
+
+/* end of file */
@@ -0,0 +1,37 @@
+/**
+ * Arbitrary baudrates for the com port
+ *
+ * Kept apart from com.h: the termios2 interface (asm/termbits.h) can't
+ * be used together with termios.h.
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+#ifndef COM_BAUD_H_INCLUDED
+#define COM_BAUD_H_INCLUDED
+
+
+/// Prototypes
+
+/**
+ * Checks if a baudrate which is not in the table can be set
+ */
+int com_custom_baud_ok (unsigned long baud);
+
+/**
+ * Sets an arbitrary baudrate on the open com port
+ *
+ * @return 0 if successfull
+ */
+int com_set_custom_baud (int fd, unsigned long baud);
+
+/**
+ * Reads the output baudrate of the open com port, standard or not
+ *
+ * @return the baudrate, 0 on error
+ */
+unsigned long com_get_baud (int fd);
+
+#endif //COM_BAUD_H_INCLUDED
@@ -0,0 +1,225 @@
+/**
+ * Device database for the bootloader of Peter Dannegger
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+
+/// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "device.h"
+
+
+// generated from devices.txt, sorted by signature
+static const device_t builtin[] = {
+#include "devtab.h"
+};
+
+#define BUILTIN_COUNT   (sizeof (builtin) / sizeof (builtin[0]))
+
+
+/// Attributes
+
+static const device_t   *table = builtin;
+static size_t           count  = BUILTIN_COUNT;
+
+
+/**
+ * Sorts and searches by signature
+ */
+static int compare_signature (const void *a, const void *b)
+{
+    unsigned long sa = ((const device_t *)a)->signature;
+    unsigned long sb = ((const device_t *)b)->signature;
+
+    return (sa > sb) - (sa < sb);
+}
+
+
+/**
+ * Looks up a device by its signature
+ */
+const device_t * device_find (unsigned long signature)
+{
+    device_t key;
+
+    key.signature = signature;
+    return bsearch (&key, table, count, sizeof (device_t), compare_signature);
+}
+
+
+/**
+ * Parses a line of devices.txt; missing columns are taken from the
+ * built in entry, or follow from the signature (the second byte tells
+ * the flash size: 0x90 1K .. 0x98 256K)
+ *
+ * @return 0 if valid
+ */
+static int device_parse (const char *line,
+                         device_t   *dev,
+                         char       *name)
+{
+    const device_t  *known;
+    unsigned long   sig;
+    unsigned long   v[4];
+    int             n;
+
+    n = sscanf (line, "%lx : %63s %lu %lu %lu %lu", &sig, name, &v[0], &v[1], &v[2], &v[3]);
+    if (n < 2)
+        return -1;
+
+    if ((known = device_find (sig)) != NULL)
+        *dev = *known;
+    else
+    {
+        memset (dev, 0, sizeof (*dev));
+        if ((sig & 0xf000) == 0x9000)
+        {
+            dev->flash    = 1024UL << ((sig >> 8) & 0x0f);
+            dev->pagesize = (dev->flash <= 8192) ? 64 : (dev->flash <= 65536) ? 128 : 256;
+            dev->bootsize = (dev->flash < 65536) ? 512 : 1024;
+        }
+    }
+    dev->signature = sig;
+
+    if (n > 2) dev->pagesize = v[0];
+    if (n > 3) dev->flash    = v[1];
+    if (n > 4) dev->bootsize = v[2];
+    if (n > 5) dev->maxbaud  = v[3];
+
+    return 0;
+}
+
+
+// an entry of a user file, its line keeps the order of equal signatures
+typedef struct
+{
+    device_t    dev;
+    size_t      line;
+} entry_t;
+
+static int compare_entry (const void *a, const void *b)
+{
+    const entry_t *ea = a;
+    const entry_t *eb = b;
+    int           c = compare_signature (&ea->dev, &eb->dev);
+
+    return c ? c : (ea->line > eb->line) - (ea->line < eb->line);
+}
+
+
+/**
+ * Merges the entries of a devices.txt into the table: all are read,
+ * sorted (the last one of a signature wins) and merged at once
+ */
+int device_load (const char *filename)
+{
+    char        path[PATH_MAX];
+    char        line[256];
+    char        name[64];
+    entry_t     *entries = NULL;
+    entry_t     *tmp;
+    size_t      size = 0;
+    size_t      n = 0;
+    size_t      lines = 0;
+    size_t      i, j, k;
+    device_t    *merged;
+    FILE        *fp;
+
+    if (filename == NULL)
+    {
+        const char *base = getenv ("XDG_CONFIG_HOME");
+        const char *home = getenv ("HOME");
+
+        if (base && *base)
+            snprintf (path, sizeof (path), "%s/fboot/devices.txt", base);
+        else if (home && *home)
+            snprintf (path, sizeof (path), "%s/.config/fboot/devices.txt", home);
+        else
+            return 0;
+
+        // it is optional
+        if ((fp = fopen (path, "r")) == NULL)
+            return 0;
+    }
+    else if ((fp = fopen (filename, "r")) == NULL)
+    {
+        printf ("File \"%s\" open failed: %s!\n", filename, strerror (errno));
+        return -1;
+    }
+
+    while (fgets (line, sizeof (line), fp))
+    {
+        lines++;
+        if (n == size)
+        {
+            size = size ? 2 * size : 64;
+            if ((tmp = realloc (entries, size * sizeof (entry_t))) == NULL)
+                break;
+            entries = tmp;
+        }
+        if (device_parse (line, &entries[n].dev, name) != 0)
+            continue;
+        if ((entries[n].dev.name = strdup (name)) == NULL)
+            break;
+        entries[n].line = lines;
+        n++;
+    }
+    fclose (fp);
+
+    if (n == 0)
+    {
+        free (entries);
+        return 0;
+    }
+
+    // by signature and line: the last of equal signatures is kept
+    qsort (entries, n, sizeof (entry_t), compare_entry);
+    for (i = j = 0; i < n; i++)
+    {
+        if ((i + 1 < n) && (entries[i].dev.signature == entries[i + 1].dev.signature))
+            free ((void *)entries[i].dev.name);
+        else
+            entries[j++] = entries[i];
+    }
+    n = j;
+
+    if ((merged = malloc ((count + n) * sizeof (device_t))) == NULL)
+    {
+        printf ("Memory allocation error, could not merge the devices!\n");
+        for (i = 0; i < n; i++)
+            free ((void *)entries[i].dev.name);
+        free (entries);
+        return -1;
+    }
+
+    // both are sorted, an entry of the file replaces one of the table
+    for (i = j = k = 0; (i < count) || (j < n); )
+    {
+        if ((j == n) || ((i < count) && (table[i].signature < entries[j].dev.signature)))
+            merged[k++] = table[i++];
+        else
+        {
+            if ((i < count) && (table[i].signature == entries[j].dev.signature))
+                i++;
+            merged[k++] = entries[j++].dev;
+        }
+    }
+    free (entries);
+
+    if (table != builtin)
+        free ((void *)table);
+    table = merged;
+    count = k;
+
+    return (int)n;
+}
+
+/* end of file */
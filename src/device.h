@@ -0,0 +1,45 @@
+/**
+ * Device database for the bootloader of Peter Dannegger
+ *
+ * The table is generated from devices.txt at build time (devtab.h),
+ * sorted by signature; a user file in the same format can add or
+ * replace entries once at startup.
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+#ifndef DEVICE_H_INCLUDED
+#define DEVICE_H_INCLUDED
+
+
+typedef struct
+{
+    unsigned long   signature;
+    const char      *name;
+    unsigned long   pagesize;   // bytes
+    unsigned long   flash;      // total flash in bytes
+    unsigned long   bootsize;   // reserved for the bootloader
+    unsigned long   maxbaud;    // recommended maximum baudrate
+} device_t;
+
+
+/// Prototypes
+
+/**
+ * Merges the entries of a devices.txt into the table; without a
+ * filename $XDG_CONFIG_HOME/fboot/devices.txt is read, if it exists
+ *
+ * @return number of entries read or -1 on error
+ */
+int device_load (const char *filename);
+
+/**
+ * Looks up a device by its signature
+ *
+ * @return entry or NULL if unknown
+ */
+const device_t * device_find (unsigned long signature);
+
+#endif //DEVICE_H_INCLUDED
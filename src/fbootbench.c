@@ -0,0 +1,548 @@
+/**
+ * Benchmarks of the host side of the bootloader of Peter Dannegger
+ *
+ * Times the work done per byte on synthetic input: reading hexfiles,
+ * the CRC, the escaping of the PROGRAM / VERIFY stream, the progress
+ * updates, reading answers and the trigger scan of the terminal mode.
+ * The worst case image consists only of the bytes that have to be
+ * escaped (0xA5, 0x13). Every kernel is compared against the time a
+ * byte needs on the wire, and optionally against a saved baseline.
+ * The hexfiles are timed per byte of the image they hold, not of
+ * their text; the progress bar is drawn to /dev/null, as often as at
+ * 10 Hz (progress) and every 16 bytes like the old loops did
+ * (progress_draw). The stream is escaped in chunks of WIRE_CHUNK, as
+ * programflash and verifyflash send it.
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+
+/// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "com.h"
+#include "image.h"
+#include "progress.h"
+#include "protocol.h"
+#include "trigger.h"
+#include "wire.h"
+
+
+#define TRUE    1
+#define FALSE   0
+
+#define MAX_RESULTS     32
+#define ROUNDS          5           // best of
+#define RECLEN          16          // data bytes per hex record
+#define WIRE_BAUD       1000000     // fastest rate the bootloader runs at
+#define ANSWERS         8192        // answers of readval in the pipe
+#define XOFF            0x13        // escaped like COMMAND
+#define FRAME_BYTES     (WIRE_BAUD / 10 / 10)   // on the wire per redraw (10 Hz)
+
+typedef struct
+{
+    char    name[32];
+    double  ns;                     // per byte
+    double  base;                   // of the baseline, 0: none
+} result_t;
+
+
+/// Attributes
+
+static result_t     results[MAX_RESULTS];
+static int          nresults = 0;
+static unsigned long min_ms = 200;  // time per round
+static int          saved_stdout = -1;
+static int          null_fd = -1;
+
+
+/**
+ * Output of the kernels (read_hexfile) is thrown away
+ */
+static void quiet (int on)
+{
+    if (on)
+    {
+        int null = open ("/dev/null", O_WRONLY);
+
+        fflush (stdout);
+        saved_stdout = dup (STDOUT_FILENO);
+        dup2 (null, STDOUT_FILENO);
+        close (null);
+    }
+    else
+    {
+        fflush (stdout);
+        dup2 (saved_stdout, STDOUT_FILENO);
+        close (saved_stdout);
+    }
+}
+
+
+/**
+ * Adds a result
+ */
+static void result (const char *name, double ns)
+{
+    if (nresults == MAX_RESULTS)
+        return;
+
+    snprintf (results[nresults].name, sizeof (results[0].name), "%s", name);
+    results[nresults].ns   = ns;
+    results[nresults].base = 0;
+    nresults++;
+}
+
+
+/**
+ * Fills an image with random data or with the bytes to be escaped only
+ */
+static void fill_image (unsigned char   *data,
+                        size_t          len,
+                        int             worst)
+{
+    size_t i;
+
+    srand (1);
+    for (i = 0; i < len; i++)
+    {
+        if (worst)
+            data[i] = (rand () & 1) ? COMMAND : XOFF;
+        else
+            data[i] = rand ();
+    }
+}
+
+
+/**
+ * Writes a hexfile of (about) size bytes; the addresses wrap at
+ * MAXFLASH, so any size can be read. databytes is set to the number
+ * of image bytes in it.
+ *
+ * @return 0 on success
+ */
+static int write_hexfile (const char    *filename,
+                          size_t        size,
+                          int           worst,
+                          size_t        *databytes)
+{
+    unsigned char   rec[RECLEN];
+    unsigned long   addr = 0;
+    size_t          written = 0;
+    FILE            *fp;
+    int             i;
+
+    if ((fp = fopen (filename, "w")) == NULL)
+    {
+        printf ("File \"%s\" open failed: %s!\n", filename, strerror (errno));
+        return -1;
+    }
+
+    srand (2);
+    *databytes = 0;
+    while (written < size)
+    {
+        unsigned char sum;
+
+        if ((addr & 0xffff) == 0)
+        {
+            sum = 0x02 + 0x04 + (addr >> 24) + (addr >> 16);
+            written += fprintf (fp, ":02000004%04lX%02X\n", addr >> 16,
+                                (unsigned char)-sum);
+        }
+
+        sum = RECLEN + (addr >> 8) + addr;
+        written += fprintf (fp, ":%02X%04lX00", RECLEN, addr & 0xffff);
+        for (i = 0; i < RECLEN; i++)
+        {
+            rec[i] = worst ? ((rand () & 1) ? COMMAND : XOFF) : rand ();
+            sum   += rec[i];
+            written += fprintf (fp, "%02X", rec[i]);
+        }
+        written += fprintf (fp, "%02X\n", (unsigned char)-sum);
+
+        addr = (addr + RECLEN) % MAXFLASH;
+        *databytes += RECLEN;
+    }
+    fprintf (fp, ":00000001FF\n");
+
+    if (fclose (fp) != 0)
+    {
+        printf ("Writing \"%s\" failed: %s!\n", filename, strerror (errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+/// Kernels, each called with the number of bytes it works on
+
+static const char       *hexname;
+static unsigned char    *image;
+static unsigned char    *escbuf;
+static int              rx_fd = -1;
+static int              tx_fd = -1;
+
+static void run_hexfile (size_t len)
+{
+    unsigned long   lastaddr;
+    char            *data = read_hexfile (hexname, &lastaddr);
+
+    free (data);
+}
+
+static void run_crc (size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        calc_crc (image[i]);
+}
+
+static void run_crc_buf (size_t len)
+{
+    calc_crc_buf (image, len);
+}
+
+/**
+ * In chunks, as programflash and verifyflash escape the image
+ */
+static void run_escape (size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i += WIRE_CHUNK)
+        wire_escape (image + i, (len - i < WIRE_CHUNK) ? len - i : WIRE_CHUNK, escbuf);
+}
+
+static void run_trigger (size_t len)
+{
+    trigger_scan ((const char *)image, len);
+    while (trigger_next ());
+}
+
+/**
+ * The loops store the position after every chunk, the bar is drawn
+ * once per FRAME_BYTES; drawn here directly, stdout is no terminal
+ */
+static void run_progress (size_t len)
+{
+    size_t i;
+
+    progress_start ("Writing", len);
+    for (i = 0; i < len; i += WIRE_CHUNK)
+    {
+        progress_update (i);
+        if ((i % FRAME_BYTES) < WIRE_CHUNK)
+            progress_draw_to (null_fd);
+    }
+    progress_done (TRUE);
+}
+
+/**
+ * Drawing the bar alone, every 16 bytes like print_perc_bar did
+ */
+static void run_progress_draw (size_t len)
+{
+    size_t i;
+
+    progress_start ("Writing", len);
+    for (i = 0; i < len; i += 16)
+    {
+        progress_update (i);
+        progress_draw_to (null_fd);
+    }
+    progress_done (TRUE);
+}
+
+/**
+ * The answers of the device are written to a pipe first, so only
+ * reading them is timed
+ */
+static void run_readval (size_t len)
+{
+    static const unsigned char answer[] = { ANSWER, 4, 0x1e, 0x93, 0x0a, SUCCESS };
+    size_t n;
+
+    for (n = 0; n < len; n += sizeof (answer))
+    {
+        if (write (tx_fd, answer, sizeof (answer)) != sizeof (answer))
+            return;
+    }
+    for (n = 0; n < len; n += sizeof (answer))
+    {
+        if (readval (rx_fd, 10) != 0x1e930a)
+        {
+            printf ("readval: wrong value!\n");
+            exit (1);
+        }
+    }
+}
+
+
+/**
+ * Times a kernel: every round runs it for at least min_ms, the best
+ * round counts
+ */
+static void bench (const char   *name,
+                   void         (*run)(size_t),
+                   size_t       len)
+{
+    double  best = 0;
+    int     round;
+
+    quiet (TRUE);
+    run (len);                      // warm up caches and page tables
+
+    for (round = 0; round < ROUNDS; round++)
+    {
+        unsigned long long start = get_time_us ();
+        unsigned long long time;
+        unsigned long      n = 0;
+
+        do
+        {
+            run (len);
+            n++;
+            time = get_time_us () - start;
+        } while (time < min_ms * 1000ULL);
+
+        if ((round == 0) || (time * 1000.0 / n / len < best))
+            best = time * 1000.0 / n / len;
+    }
+    quiet (FALSE);
+
+    result (name, best);
+}
+
+
+/**
+ * Reads the results of a previous run
+ *
+ * @return 0 on success
+ */
+static int load_baseline (const char *filename)
+{
+    char    line[128];
+    char    name[32];
+    double  ns;
+    FILE    *fp;
+    int     i;
+
+    if ((fp = fopen (filename, "r")) == NULL)
+    {
+        printf ("Baseline \"%s\" open failed: %s!\n", filename, strerror (errno));
+        return -1;
+    }
+
+    while (fgets (line, sizeof (line), fp))
+    {
+        if ((line[0] == '#') || (sscanf (line, "%31s %lf", name, &ns) != 2))
+            continue;
+        for (i = 0; i < nresults; i++)
+            if (strcmp (results[i].name, name) == 0)
+                results[i].base = ns;
+    }
+    fclose (fp);
+    return 0;
+}
+
+
+/**
+ * Writes the results as baseline
+ *
+ * @return 0 on success
+ */
+static int save_baseline (const char *filename)
+{
+    FILE    *fp;
+    int     i;
+
+    if ((fp = fopen (filename, "w")) == NULL)
+    {
+        printf ("Baseline \"%s\" open failed: %s!\n", filename, strerror (errno));
+        return -1;
+    }
+
+    fprintf (fp, "# kernel ns/byte\n");
+    for (i = 0; i < nresults; i++)
+        fprintf (fp, "%s %.4f\n", results[i].name, results[i].ns);
+
+    if (fclose (fp) != 0)
+    {
+        printf ("Writing \"%s\" failed: %s!\n", filename, strerror (errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Prints the results
+ *
+ * @return number of kernels slower than the baseline by more than
+ *         limit percent, or slower than the wire
+ */
+static int print_results (double limit)
+{
+    double  wire_ns = 10e9 / WIRE_BAUD;
+    int     bad = 0;
+    int     i;
+
+    printf ("Kernel            ns/byte   of wire  baseline  change\n");
+    for (i = 0; i < nresults; i++)
+    {
+        result_t *r = &results[i];
+        int      slow = (r->ns > wire_ns);
+
+        printf ("%-16s %8.3f %8.2f%%", r->name, r->ns, 100.0 * r->ns / wire_ns);
+        if (r->base > 0)
+        {
+            double change = 100.0 * (r->ns - r->base) / r->base;
+
+            printf (" %9.3f %+6.1f%%", r->base, change);
+            if (change > limit)
+                slow = TRUE;
+        }
+        printf ("%s\n", slow ? "  SLOW" : "");
+        bad += slow;
+    }
+    printf ("(wire: %.0f ns/byte at %d baud)\n", wire_ns, WIRE_BAUD);
+
+    return bad;
+}
+
+
+/**
+ * Prints usage
+ */
+static void usage (const char *name)
+{
+    printf ("%s [-c baseline] [-s baseline] [-l percent] [-m ms]\n"
+            "-c file     compare with a saved baseline\n"
+            "-s file     save the results as baseline\n"
+            "-l percent  allowed slowdown against the baseline, default 10\n"
+            "-m ms       time of every round, default 200\n"
+            "Exit code 1 if a kernel is slower than the wire at %d baud\n"
+            "or than the baseline.\n", name, WIRE_BAUD);
+}
+
+
+/**
+ * Main
+ */
+int main (int argc, char *argv[])
+{
+    static const size_t hexsizes[] = { 32 * 1024, 512 * 1024, 4 * 1024 * 1024 };
+    const char      *compare = NULL;
+    const char      *save = NULL;
+    double          limit = 10;
+    char            tmpname[] = "/tmp/fbootbenchXXXXXX";
+    char            name[32];
+    int             pfd[2];
+    int             fd;
+    int             worst;
+    int             opt;
+    size_t          i;
+    size_t          databytes;
+
+    while ((opt = getopt (argc, argv, "c:s:l:m:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c': compare = optarg; break;
+            case 's': save    = optarg; break;
+            case 'l': limit   = atof (optarg); break;
+            case 'm': min_ms  = strtoul (optarg, NULL, 0); break;
+            default:
+                usage (argv[0]);
+                return (opt == 'h') ? 0 : 2;
+        }
+    }
+
+    image  = malloc (MAXFLASH);
+    escbuf = malloc (2 * MAXFLASH);
+    if (!image || !escbuf)
+    {
+        printf ("Memory allocation error!\n");
+        return 2;
+    }
+
+    if ((fd = mkstemp (tmpname)) < 0)
+    {
+        printf ("Temporary file failed: %s!\n", strerror (errno));
+        return 2;
+    }
+    close (fd);
+    hexname = tmpname;
+
+    image_cache (FALSE);
+
+    for (worst = 0; worst < 2; worst++)
+    {
+        for (i = 0; i < sizeof (hexsizes) / sizeof (hexsizes[0]); i++)
+        {
+            if (write_hexfile (tmpname, hexsizes[i], worst, &databytes) < 0)
+            {
+                unlink (tmpname);
+                return 2;
+            }
+            // per byte of the image, like the wire time
+            snprintf (name, sizeof (name), "hex_%luk%s",
+                      (unsigned long)hexsizes[i] / 1024, worst ? "_esc" : "");
+            bench (name, run_hexfile, databytes);
+        }
+    }
+    unlink (tmpname);
+
+    for (worst = 0; worst < 2; worst++)
+    {
+        fill_image (image, MAXFLASH, worst);
+        bench (worst ? "crc_256k_esc" : "crc_256k", run_crc, MAXFLASH);
+        bench (worst ? "crc_buf_256k_esc" : "crc_buf_256k", run_crc_buf, MAXFLASH);
+        bench (worst ? "escape_256k_esc" : "escape_256k", run_escape, MAXFLASH);
+    }
+
+    // some banners a rig would wait for
+    trigger_add ("ENTER BOOTLOADER", "program");
+    trigger_add ("version mismatch", "program");
+    trigger_add ("PASS\\r\\n", "mark");
+    trigger_add ("FAIL", "reset");
+    trigger_add ("login: ", "send=root\\r");
+    if (trigger_build () < 0)
+        return 2;
+    bench ("trigger_256k", run_trigger, MAXFLASH);
+
+    if ((null_fd = open ("/dev/null", O_WRONLY)) < 0)
+    {
+        printf ("/dev/null open failed: %s!\n", strerror (errno));
+        return 2;
+    }
+    bench ("progress", run_progress, 16 * FRAME_BYTES);
+    bench ("progress_draw", run_progress_draw, 16 * 1024);
+
+    if (pipe (pfd) < 0)
+    {
+        printf ("Pipe failed: %s!\n", strerror (errno));
+        return 2;
+    }
+    rx_fd = pfd[0];
+    tx_fd = pfd[1];
+    bench ("readval", run_readval, ANSWERS * 6);
+
+    if (compare && (load_baseline (compare) < 0))
+        return 2;
+    if (save && (save_baseline (save) < 0))
+        return 2;
+
+    return print_results (limit) ? 1 : 0;
+}
+
+/* end of file */
@@ -0,0 +1,636 @@
+/**
+ * FastBoot emulator: simulates an AVR running the bootloader of
+ * Peter Dannegger on a pseudo terminal, so the host program can be
+ * tested and benchmarked without hardware.
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+
+/// Includes
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "com_baud.h"
+#include "protocol.h"
+
+
+/**************************************************************/
+/*                          CONSTANTS                         */
+/**************************************************************/
+#define TRUE    1
+#define FALSE   0
+
+// flash used by the bootloader itself
+#define BOOTSIZE    512
+
+// largest read from the pty
+#define RX_CHUNK    4096
+
+// states of the emulated controller
+typedef enum {
+    ST_APPLICATION = 0,     // application runs, wait for password
+    ST_CONNECT,             // password received, wait for last char
+    ST_IDLE,                // connected, wait for COMMAND
+    ST_COMMAND,             // COMMAND received, wait for command byte
+    ST_CRC_LO,              // CHECK_CRC, wait for low byte
+    ST_CRC_HI,              // CHECK_CRC, wait for high byte
+    ST_PROGRAM,             // receiving program data
+    ST_VERIFY               // receiving verify data
+} emu_state_t;
+
+
+/**************************************************************/
+/*                          GLOBALS                           */
+/**************************************************************/
+static int          running = TRUE;
+
+// emulated controller
+static unsigned long signature  = 0x1e930a;
+static unsigned long flashsize  = 7680;
+static unsigned long buffsize   = 960;
+static unsigned long revision   = 0x0201;
+static unsigned long pagesize   = 64;
+static const char    *password  = "Peda";
+static int           one_wire   = FALSE;
+static const char    *banner    = NULL;
+
+// timing
+static unsigned long baud       = 0;    // 0: no pacing
+static int           host_pacing = FALSE; // pace at the rate the host set
+static unsigned long page_us    = 4500; // time to erase and write one page
+static unsigned long late_ms    = 0;    // additional delay for CONTINUE
+static unsigned long late_every = 0;    // ...on every n-th block only
+
+// faults
+static double        drop_rate  = 0.0;  // probability to lose a byte
+static unsigned long crc_fail   = 0;    // n-th CHECK_CRC fails
+static unsigned long disc_after = 0;    // disconnect after n bytes
+static unsigned long max_baud   = 0;    // autobaud fails above this rate
+static long          no_verify  = -1;   // no VERIFY, BADCOMMAND after ms
+
+// state
+static emu_state_t   state      = ST_APPLICATION;
+static unsigned char flash[MAXFLASH];
+static unsigned int  crc        = 0;
+static unsigned long addr       = 0;
+static unsigned long blockcnt   = 0;
+static unsigned long blocks     = 0;
+static unsigned long crc_checks = 0;
+static unsigned long rx_total   = 0;
+static int           escape     = FALSE;
+static int           verify_ok  = TRUE;
+static size_t        pw_pos     = 0;
+
+static int           fd_master  = -1;
+
+
+/*****************************************************************************
+ *
+ *      Signal handler
+ *
+ ****************************************************************************/
+static void sig_handler(int signal)
+{
+    running = FALSE;
+}
+
+
+/**
+ * Sleep for the given number of microseconds
+ */
+static void sleep_us (unsigned long us)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while ((nanosleep (&ts, &ts) < 0) && (errno == EINTR) && running);
+}
+
+/**
+ * Time in usec to transfer n bytes 8N1
+ */
+static unsigned long host_baud (void);
+
+static unsigned long wire_us (unsigned long n)
+{
+    unsigned long rate = host_pacing ? host_baud () : baud;
+
+    if (rate == 0)
+        return 0;
+    return (n * 10UL * 1000000UL) / rate;
+}
+
+/**
+ * Bytes to take from the pty at once: with pacing about 10ms of the
+ * wire, so the host sees its output queue drain at line rate
+ */
+static size_t read_max (void)
+{
+    unsigned long rate = host_pacing ? host_baud () : baud;
+    size_t        n    = rate / 1000;
+
+    if (rate == 0)
+        return RX_CHUNK;
+    return (n == 0) ? 1 : (n > RX_CHUNK) ? RX_CHUNK : n;
+}
+
+/**
+ * Baudrate the host has set on the pty
+ */
+static unsigned long host_baud (void)
+{
+    return com_get_baud (fd_master);
+}
+
+/**
+ * Send answer bytes to the host
+ */
+static void emu_send (const unsigned char *buf,
+                      size_t              len)
+{
+    sleep_us (wire_us (len));
+
+    while (len > 0)
+    {
+        ssize_t n = write (fd_master, buf, len);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                struct pollfd pfd = { fd_master, POLLOUT, 0 };
+                poll (&pfd, 1, 100);
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void emu_putc (unsigned char c)
+{
+    emu_send (&c, 1);
+}
+
+/**
+ * Send an ANSWER frame with n value bytes
+ */
+static void emu_answer (unsigned long val,
+                        int           n)
+{
+    unsigned char buf[8];
+    int i = 0;
+
+    buf[i++] = ANSWER;
+    buf[i++] = n + 1;
+    while (n--)
+        buf[i++] = val >> (8 * n);
+    buf[i++] = SUCCESS;
+
+    emu_send (buf, i);
+}
+
+/**
+ * Update the receive CRC like the controller does
+ */
+static void emu_crc (unsigned char d)
+{
+    int i;
+
+    crc ^= d;
+    for (i = 8; i; i--)
+        crc = (crc >> 1) ^ ((crc & 1) ? 0xA001 : 0);
+}
+
+/**
+ * Simulate the flash page write of the received part of a block
+ */
+static void emu_write_pages (unsigned long count)
+{
+    if (count == 0)
+        return;
+    sleep_us (((count + pagesize - 1) / pagesize) * page_us);
+}
+
+/**
+ * Store one received byte of the PROGRAM or VERIFY data stream
+ */
+static void emu_data (unsigned char d)
+{
+    if (state == ST_PROGRAM)
+    {
+        if (addr < flashsize)
+            flash[addr] = d;
+        addr++;
+
+        if (++blockcnt == buffsize)
+        {
+            emu_write_pages (blockcnt);
+            blockcnt = 0;
+            blocks++;
+            if (late_ms && (late_every == 0 || (blocks % late_every) == 0))
+                sleep_us (late_ms * 1000UL);
+            emu_putc (CONTINUE);
+        }
+    }
+    else
+    {
+        if ((addr >= flashsize) || (flash[addr] != d))
+            verify_ok = FALSE;
+        addr++;
+    }
+}
+
+/**
+ * Handle a command byte following COMMAND
+ */
+static void emu_command (unsigned char c)
+{
+    state = ST_IDLE;
+
+    switch (c)
+    {
+        case COMMAND:
+            emu_putc (SUCCESS);
+            break;
+        case REVISION:
+            emu_answer (revision, 2);
+            break;
+        case BUFFSIZE:
+            emu_answer (buffsize, 2);
+            break;
+        case SIGNATURE:
+            emu_answer (signature, 3);
+            break;
+        case USERFLASH:
+            emu_answer (flashsize, 3);
+            break;
+        case VERIFY:
+            if (no_verify >= 0)
+            {
+                // a slow adaptor delays the answer
+                sleep_us (no_verify * 1000UL);
+                emu_putc (BADCOMMAND);
+                break;
+            }
+            // FALLTHROUGH
+        case PROGRAM:
+            state     = (c == PROGRAM) ? ST_PROGRAM : ST_VERIFY;
+            addr      = 0;
+            blockcnt  = 0;
+            blocks    = 0;
+            escape    = FALSE;
+            verify_ok = TRUE;
+            break;
+        case CHECK_CRC:
+            state = ST_CRC_LO;
+            break;
+        case START:
+            state  = ST_APPLICATION;
+            pw_pos = 0;
+            if (banner)
+            {
+                emu_send ((const unsigned char *)banner, strlen (banner));
+                emu_send ((const unsigned char *)"\r\n", 2);
+            }
+            break;
+        default:
+            emu_putc (BADCOMMAND);
+            break;
+    }
+}
+
+/**
+ * Handle one byte received from the host
+ */
+static void emu_receive (unsigned char c)
+{
+    if (one_wire)
+        emu_putc (c);
+
+    if (state >= ST_IDLE)
+        emu_crc (c);
+
+    switch (state)
+    {
+        case ST_APPLICATION:
+            if (max_baud && (host_baud () > max_baud))
+                break;
+            // the application just echoes lines; the password
+            // makes it jump into the bootloader (like a reset)
+            if (c == (unsigned char)password[pw_pos])
+            {
+                if (password[++pw_pos] == '\0')
+                    state = ST_CONNECT;
+            }
+            else
+            {
+                pw_pos = (c == (unsigned char)password[0]) ? 1 : 0;
+                if (banner && c >= ' ' && c < 0x7f)
+                    emu_putc (c);
+                else if (banner && c == '\r')
+                    emu_send ((const unsigned char *)"\r\n", 2);
+            }
+            break;
+
+        case ST_CONNECT:
+            // CONNECT is sent on the start edge of the last character
+            emu_putc (CONNECT);
+            crc   = 0;
+            state = ST_IDLE;
+            break;
+
+        case ST_IDLE:
+            if (c == COMMAND)
+                state = ST_COMMAND;
+            break;
+
+        case ST_COMMAND:
+            emu_command (c);
+            break;
+
+        case ST_CRC_LO:
+            state = ST_CRC_HI;
+            break;
+
+        case ST_CRC_HI:
+            crc_checks++;
+            if (crc_fail && crc_checks == crc_fail)
+                crc ^= 0x5555;
+            emu_putc (crc ? FAIL : SUCCESS);
+            crc   = 0;
+            state = ST_IDLE;
+            break;
+
+        case ST_PROGRAM:
+        case ST_VERIFY:
+            if (escape)
+            {
+                escape = FALSE;
+                if (c == ESC_SHIFT)
+                {
+                    // end of data
+                    if (state == ST_PROGRAM)
+                    {
+                        emu_write_pages (blockcnt);
+                        emu_putc (SUCCESS);
+                    }
+                    else
+                    {
+                        emu_putc (verify_ok ? SUCCESS : FAIL);
+                    }
+                    state = ST_IDLE;
+                }
+                else
+                {
+                    emu_data (c - ESC_SHIFT);
+                }
+            }
+            else if (c == ESCAPE)
+            {
+                escape = TRUE;
+            }
+            else
+            {
+                emu_data (c);
+            }
+            break;
+    }
+}
+
+/**
+ * Look up the signature in devices.txt: name, page, flash and boot size
+ */
+static void lookup_device (const char *filename,
+                           int        sizes_given)
+{
+    FILE *fp;
+    char s[256];
+    char name[64];
+    unsigned long sig, page, flash, boot;
+    int n;
+
+    if ((fp = fopen (filename, "r")) == NULL)
+        return;
+
+    while (fgets (s, sizeof (s), fp))
+    {
+        n = sscanf (s, "%lx : %63s %lu %lu %lu", &sig, name, &page, &flash, &boot);
+        if ((n >= 2) && (sig == signature))
+        {
+            printf ("Target        : %06lX %s\n", sig, name);
+            if ((n == 5) && !(sizes_given & 1))
+                flashsize = flash - boot;
+            if ((n >= 3) && !(sizes_given & 2))
+                pagesize = page;
+            break;
+        }
+    }
+    fclose (fp);
+}
+
+/**
+ * prints usage
+ */
+static void usage (const char *name)
+{
+    printf ("%s [options]\n"
+            "-l path         create symlink to the pty slave at path\n"
+            "-s sig          signature (hex), default 1e930a; flash and page size\n"
+            "                follow from it, unless given\n"
+            "-f nn           user flash size in bytes, default 7680\n"
+            "-B nn           buffer size, default 960\n"
+            "-g nn           page size, default 64\n"
+            "-P pwd          password, default Peda\n"
+            "-1              one-wire mode, echo every received byte\n"
+            "-b nn|host      simulate wire time of baudrate nn (or of the rate\n"
+            "                the host has set)\n"
+            "-W us           time for erasing and writing one page, default 4500\n"
+            "-a text         application banner, printed after START\n"
+            "-D file         devices.txt to look up the signature (name and sizes)\n"
+            "Faults:\n"
+            "-x rate         drop received bytes with probability rate (0..1)\n"
+            "-c n            let the n-th CRC check fail\n"
+            "-L ms[/n]       delay CONTINUE by ms (on every n-th block)\n"
+            "-X n            disconnect after n received bytes\n"
+            "-M nn           autobaud fails above baudrate nn\n"
+            "-V ms           no VERIFY command, BADCOMMAND after ms\n", name);
+    exit (1);
+}
+
+
+/**
+ * Main, startup
+ */
+int main (int argc, char *argv[])
+{
+    const char      *link_path = NULL;
+    const char      *devfile = NULL;
+    struct sigaction sa;
+    struct termios  tio;
+    int             fd_slave;
+    int             sizes_given = 0;
+    int             i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if ((i + 1 < argc) && (argv[i][0] == '-') && strchr ("lsfBgPbWaDxcLXMV", argv[i][1]))
+        {
+            const char *arg = argv[++i];
+
+            switch (argv[i-1][1])
+            {
+                case 'l': link_path  = arg; break;
+                case 's': signature  = strtoul (arg, NULL, 16); sizes_given |= 4; break;
+                case 'f': flashsize  = strtoul (arg, NULL, 0); sizes_given |= 1; break;
+                case 'B': buffsize   = strtoul (arg, NULL, 0); break;
+                case 'g': pagesize   = strtoul (arg, NULL, 0); sizes_given |= 2; break;
+                case 'P': password   = arg; break;
+                case 'b':
+                    baud        = strtoul (arg, NULL, 0);
+                    host_pacing = (strcmp (arg, "host") == 0);
+                    break;
+                case 'W': page_us    = strtoul (arg, NULL, 0); break;
+                case 'a': banner     = arg; break;
+                case 'D': devfile    = arg; break;
+                case 'x': drop_rate  = atof (arg); break;
+                case 'c': crc_fail   = strtoul (arg, NULL, 0); break;
+                case 'X': disc_after = strtoul (arg, NULL, 0); break;
+                case 'M': max_baud   = strtoul (arg, NULL, 0); break;
+                case 'V': no_verify  = strtol (arg, NULL, 0); break;
+                case 'L':
+                    late_ms = strtoul (arg, NULL, 0);
+                    if (strchr (arg, '/'))
+                        late_every = strtoul (strchr (arg, '/') + 1, NULL, 0);
+                    break;
+            }
+        }
+        else if (strcmp (argv[i], "-1") == 0)
+        {
+            one_wire = TRUE;
+        }
+        else
+        {
+            usage (argv[0]);
+        }
+    }
+
+    // the second signature byte tells the flash size (0x90: 1K .. 0x98: 256K)
+    if ((sizes_given & 4) && ((signature & 0xf000) == 0x9000))
+    {
+        unsigned long total = 1024UL << ((signature >> 8) & 0x0f);
+
+        if (!(sizes_given & 1))
+            flashsize = total - BOOTSIZE;
+        if (!(sizes_given & 2))
+            pagesize = (total <= 8192) ? 64 : (total <= 65536) ? 128 : 256;
+    }
+
+    if (devfile)
+        lookup_device (devfile, sizes_given);
+
+    if ((flashsize > MAXFLASH) || (buffsize == 0) || (pagesize == 0))
+    {
+        printf ("Invalid flash, buffer or page size!\n");
+        return 1;
+    }
+
+    sa.sa_handler = sig_handler;
+    sa.sa_flags = 0;
+    sigemptyset (&sa.sa_mask);
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
+
+    fd_master = posix_openpt (O_RDWR | O_NOCTTY);
+    if ((fd_master < 0) || grantpt (fd_master) || unlockpt (fd_master))
+    {
+        perror ("Opening pseudo terminal failed");
+        return 2;
+    }
+
+    // keep the slave open, so the pty survives the host closing it
+    fd_slave = open (ptsname (fd_master), O_RDWR | O_NOCTTY);
+    if (fd_slave < 0)
+    {
+        perror ("Opening pseudo terminal slave failed");
+        return 2;
+    }
+    tcgetattr (fd_slave, &tio);
+    cfmakeraw (&tio);
+    tcsetattr (fd_slave, TCSANOW, &tio);
+
+    if (link_path)
+    {
+        unlink (link_path);
+        if (symlink (ptsname (fd_master), link_path) < 0)
+            perror ("Creating symlink failed");
+    }
+
+    memset (flash, 0xff, sizeof (flash));
+    srand (time (NULL));
+
+    printf ("Emulating    : %06lX, flash %lu, buffer %lu, page %lu\n",
+            signature, flashsize, buffsize, pagesize);
+    printf ("Port         : %s\n", link_path ? link_path : ptsname (fd_master));
+    fflush (stdout);
+
+    while (running)
+    {
+        unsigned char buf[RX_CHUNK];
+        struct pollfd pfd = { fd_master, POLLIN, 0 };
+        ssize_t n;
+
+        if (poll (&pfd, 1, 500) <= 0)
+            continue;
+
+        n = read (fd_master, buf, read_max ());
+        if (n <= 0)
+            continue;
+
+        // the bytes needed their time on the wire
+        sleep_us (wire_us (n));
+
+        for (i = 0; i < n; i++)
+        {
+            rx_total++;
+            if (disc_after && rx_total >= disc_after)
+            {
+                printf ("Disconnect after %lu bytes\n", rx_total);
+                running = FALSE;
+                break;
+            }
+            if ((drop_rate > 0.0) && (state >= ST_IDLE) &&
+                ((double)rand () / RAND_MAX < drop_rate))
+                continue;
+
+            emu_receive (buf[i]);
+        }
+    }
+
+    if (link_path)
+        unlink (link_path);
+    close (fd_slave);
+    close (fd_master);
+
+    return 0;
+}
+
+/* end of file */
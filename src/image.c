@@ -0,0 +1,811 @@
+/**
+ * Reading of flash images for the bootloader of Peter Dannegger
+ *
+ * Images are read from Intel HEX, raw binary or ELF files; all files are
+ * mapped, none is read line by line. Decoded images are kept in a cache
+ * and mapped from there as long as the file does not change, together
+ * with the CRC of their PROGRAM transfer.
+ *
+ * The Intel HEX file is mapped and decoded in place; the hex digits are
+ * converted by a lookup table and every record checksum is checked.
+ * Supported records:
+ *   00 data, 01 end of file,
+ *   02 extended segment address, 04 extended linear address,
+ *   03 / 05 start address (ignored, the application starts at 0)
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+
+/// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "com.h"
+#include "image.h"
+#include "protocol.h"
+#include "wire.h"
+
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+// marks an invalid character in the hex table
+#define NO_HEX  0x10
+
+// ELF definitions needed for AVR files
+#define ELF_MAGIC       "\177ELF"
+#define ELF_HEADER      52          // size of the 32 bit file header
+#define ELF_PHDR        32          // size of a 32 bit program header
+#define PT_LOAD         1
+#define ELF_DATA_START  0x800000    // AVR: RAM, EEPROM, fuses... start here
+
+// cache entries
+#define CACHE_MAGIC     "FBC1"
+#define CACHE_VERSION   2
+#define CACHE_MAPS      8       // max. number of mapped entries at once
+
+// header of a cache entry (local file, native byte order), followed
+// by the image up to lastaddr
+typedef struct
+{
+    char        magic[4];
+    uint32_t    version;
+    uint64_t    size;           // key: size, modification and change
+    int64_t     mtime;          //      time and inode of the file
+    int64_t     mtime_ns;
+    int64_t     ctime;
+    int64_t     ctime_ns;
+    uint64_t    dev;
+    uint64_t    ino;
+    uint64_t    base;           //      load address (raw binary)
+    uint32_t    lastaddr;
+    uint32_t    crc;            // CRC of the PROGRAM transfer
+} cacheHeader_t;
+
+// images of the cache (mapped) or just stored (map NULL), with their
+// PROGRAM CRC
+static struct
+{
+    char            *data;
+    void            *map;
+    size_t          len;
+    unsigned long   lastaddr;
+    unsigned int    crc;
+} cache_maps[CACHE_MAPS];
+
+static int           use_cache = 1;
+
+// value of each character as hex digit, NO_HEX if it is none
+static unsigned char hexval[256];
+static int           hexval_ok = 0;
+
+
+/**
+ * Fill the table of hex digits
+ */
+static void init_hexval (void)
+{
+    int i;
+
+    memset (hexval, NO_HEX, sizeof (hexval));
+    for (i = 0; i < 10; i++)
+    {
+        hexval['0' + i] = i;
+    }
+    for (i = 0; i < 6; i++)
+    {
+        hexval['A' + i] = 10 + i;
+        hexval['a' + i] = 10 + i;
+    }
+    hexval_ok = 1;
+}
+
+
+/**
+ * Decodes n bytes (2 * n hex digits)
+ *
+ * @return 0 if ok, -1 on an invalid digit
+ */
+static int decode_hex (const unsigned char  *p,
+                       unsigned char        *out,
+                       int                  n)
+{
+    unsigned char hi, lo;
+
+    while (n--)
+    {
+        hi = hexval[*p++];
+        lo = hexval[*p++];
+        if ((hi | lo) & NO_HEX)
+        {
+            return -1;
+        }
+        *out++ = (hi << 4) | lo;
+    }
+    return 0;
+}
+
+
+/**
+ * Parses the mapped hex file into data
+ *
+ * @return 0 on success, -1 on error
+ */
+static int parse_hex (const unsigned char   *p,
+                      const unsigned char   *end,
+                      char                  *data,
+                      unsigned long         *lastaddr)
+{
+    unsigned char   rec[5 + 255];   // count, address, type, data, checksum
+    unsigned char   sum;
+    unsigned long   base = 0;
+    unsigned long   addr;
+    unsigned long   line = 0;
+    int             len;
+    int             i;
+
+    while (p < end)
+    {
+        // skip line ends and blanks between records
+        if ((*p == '\n') || (*p == '\r') || (*p == ' ') || (*p == '\t'))
+        {
+            if (*p++ == '\n')
+                line++;
+            continue;
+        }
+
+        if ((*p != ':') || (end - p < 11))
+        {
+            printf("\n  Line %lu: no hex record!\n", line + 1);
+            return -1;
+        }
+        p++;
+
+        if (decode_hex (p, rec, 1) < 0)
+        {
+            printf("\n  Line %lu: no hex number!\n", line + 1);
+            return -1;
+        }
+        len = rec[0];
+
+        if ((end - p < 2 * (len + 5)) || (decode_hex (p + 2, rec + 1, len + 4) < 0))
+        {
+            printf("\n  Line %lu: no hex number or record too short!\n", line + 1);
+            return -1;
+        }
+        p += 2 * (len + 5);
+
+        for (sum = 0, i = 0; i < len + 5; i++)
+        {
+            sum += rec[i];
+        }
+        if (sum != 0)
+        {
+            printf("\n  Line %lu: checksum error!\n", line + 1);
+            return -1;
+        }
+
+        switch (rec[3])
+        {
+            case 0x00:  // data
+                addr = base + ((rec[1] << 8) | rec[2]);
+                if (addr + len > MAXFLASH)
+                {
+                    printf("\n  Hex-file too large for target!\n");
+                    return -1;
+                }
+                memcpy (data + addr, rec + 4, len);
+                if ((len > 0) && (*lastaddr < addr + len - 1))
+                {
+                    *lastaddr = addr + len - 1;
+                }
+                break;
+
+            case 0x01:  // end of file
+                return 0;
+
+            case 0x02:  // extended segment address
+                base = ((rec[4] << 8) | rec[5]) * 16L;
+                break;
+
+            case 0x04:  // extended linear address
+                base = (unsigned long)((rec[4] << 8) | rec[5]) << 16;
+                break;
+
+            case 0x03:  // start segment address
+            case 0x05:  // start linear address
+                break;
+
+            default:
+                printf("\n  Line %lu: unknown record type %02X!\n", line + 1, rec[3]);
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Read little endian values
+ */
+static unsigned long get_le16 (const unsigned char *p)
+{
+    return (unsigned long)p[0] | ((unsigned long)p[1] << 8);
+}
+
+static unsigned long get_le32 (const unsigned char *p)
+{
+    return get_le16 (p) | (get_le16 (p + 2) << 16);
+}
+
+
+/**
+ * Allocate the flash buffer, filled with 0xFF
+ */
+static char * alloc_image (unsigned long *lastaddr)
+{
+    char *data;
+
+    data = malloc(MAXFLASH);
+    if (data == NULL)
+    {
+        printf("Memory allocation error, could not get %d bytes for flash-buffer!\n",
+               MAXFLASH);
+        return NULL;
+    }
+
+    *lastaddr = 0;
+    memset (data, 0xff, MAXFLASH);
+
+    return data;
+}
+
+
+/**
+ * Map a file for reading
+ *
+ * @return 0 on success (*map is NULL for an empty file), -1 on error
+ */
+static int map_file (const char *filename,
+                     void       **map,
+                     size_t     *len)
+{
+    struct stat st;
+    int         fd;
+
+    *map = NULL;
+    *len = 0;
+
+    if (((fd = open (filename, O_RDONLY)) < 0) || (fstat (fd, &st) < 0))
+    {
+        printf("File \"%s\" open failed: %s!\n\n", filename, strerror(errno));
+        if (fd >= 0)
+            close (fd);
+        return -1;
+    }
+
+    printf("Reading       : %s... ", filename);
+
+    if (st.st_size > 0)
+    {
+        *map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (*map == MAP_FAILED)
+        {
+            printf("\n  Mapping file failed: %s!\n", strerror(errno));
+            *map = NULL;
+            close (fd);
+            return -1;
+        }
+        *len = st.st_size;
+        madvise (*map, *len, MADV_SEQUENTIAL);
+    }
+    close (fd);
+
+    return 0;
+}
+
+
+/**
+ * Read a hexfile
+ */
+char * read_hexfile (const char     *filename,
+                     unsigned long  *lastaddr)
+{
+    char        *data;
+    void        *map;
+    size_t      len;
+    int         ret = 0;
+
+    if (!hexval_ok)
+        init_hexval ();
+
+    if ((data = alloc_image (lastaddr)) == NULL)
+        return NULL;
+
+    if (map_file (filename, &map, &len) < 0)
+    {
+        free(data);
+        return NULL;
+    }
+
+    if (map)
+    {
+        ret = parse_hex (map, (const unsigned char *)map + len, data, lastaddr);
+        munmap (map, len);
+    }
+
+    if (ret < 0)
+    {
+        free(data);
+        return NULL;
+    }
+
+    printf("File read.\n");
+    return data;
+}
+
+
+/**
+ * Read a raw binary file, loaded at address base
+ */
+char * read_binfile (const char     *filename,
+                     unsigned long  base,
+                     unsigned long  *lastaddr)
+{
+    char        *data;
+    void        *map;
+    size_t      len;
+
+    if ((data = alloc_image (lastaddr)) == NULL)
+        return NULL;
+
+    if (map_file (filename, &map, &len) < 0)
+    {
+        free(data);
+        return NULL;
+    }
+
+    if ((base > MAXFLASH) || (len > MAXFLASH - base))
+    {
+        printf("\n  Binary file too large for target!\n");
+        if (map)
+            munmap (map, len);
+        free(data);
+        return NULL;
+    }
+
+    if (map)
+    {
+        memcpy (data + base, map, len);
+        munmap (map, len);
+        *lastaddr = base + len - 1;
+    }
+
+    printf("File read.\n");
+    return data;
+}
+
+
+/**
+ * Read an AVR ELF file: the PT_LOAD segments are loaded at their
+ * physical address, which is the flash address for .text and .data;
+ * segments outside of the flash (EEPROM, fuses, ...) are skipped
+ */
+char * read_elffile (const char     *filename,
+                     unsigned long  *lastaddr)
+{
+    const unsigned char *elf;
+    const unsigned char *ph;
+    unsigned long   phoff, phentsize, phnum;
+    unsigned long   offset, paddr, filesz;
+    unsigned long   i;
+    char            *data;
+    void            *map;
+    size_t          len;
+
+    if ((data = alloc_image (lastaddr)) == NULL)
+        return NULL;
+
+    if (map_file (filename, &map, &len) < 0)
+    {
+        free(data);
+        return NULL;
+    }
+    elf = map;
+
+    // 32 bit, little endian (AVR)
+    if ((len < ELF_HEADER) || (memcmp (elf, ELF_MAGIC, 4) != 0) ||
+        (elf[4] != 1) || (elf[5] != 1))
+    {
+        printf("\n  No 32 bit little endian ELF file!\n");
+        goto error;
+    }
+
+    phoff     = get_le32 (elf + 28);
+    phentsize = get_le16 (elf + 42);
+    phnum     = get_le16 (elf + 44);
+
+    if ((phentsize < ELF_PHDR) || (phoff > len) ||
+        (phnum > (len - phoff) / phentsize))
+    {
+        printf("\n  Invalid ELF program header!\n");
+        goto error;
+    }
+
+    for (i = 0; i < phnum; i++)
+    {
+        ph = elf + phoff + i * phentsize;
+
+        offset = get_le32 (ph + 4);
+        paddr  = get_le32 (ph + 12);
+        filesz = get_le32 (ph + 16);
+
+        if ((get_le32 (ph) != PT_LOAD) || (filesz == 0) ||
+            (paddr >= ELF_DATA_START))
+        {
+            continue;
+        }
+
+        if ((offset > len) || (filesz > len - offset))
+        {
+            printf("\n  Invalid ELF segment!\n");
+            goto error;
+        }
+        if ((paddr > MAXFLASH) || (filesz > MAXFLASH - paddr))
+        {
+            printf("\n  ELF file too large for target!\n");
+            goto error;
+        }
+
+        memcpy (data + paddr, elf + offset, filesz);
+        if (*lastaddr < paddr + filesz - 1)
+        {
+            *lastaddr = paddr + filesz - 1;
+        }
+    }
+
+    munmap (map, len);
+
+    printf("File read.\n");
+    return data;
+
+error:
+    if (map)
+        munmap (map, len);
+    free(data);
+    return NULL;
+}
+
+
+/**
+ * Read an image: ELF files are recognized by their magic, raw binaries
+ * by the extension .bin, everything else is read as Intel HEX
+ */
+char * read_image (const char       *filename,
+                   unsigned long    base,
+                   unsigned long    *lastaddr)
+{
+    const char  *ext = strrchr (filename, '.');
+    char        magic[4];
+    FILE        *fp;
+
+    if ((fp = fopen (filename, "rb")) != NULL)
+    {
+        if ((fread (magic, 1, 4, fp) == 4) &&
+            (memcmp (magic, ELF_MAGIC, 4) == 0))
+        {
+            fclose (fp);
+            return read_elffile (filename, lastaddr);
+        }
+        fclose (fp);
+    }
+
+    if (ext && (strcasecmp (ext, ".bin") == 0))
+    {
+        return read_binfile (filename, base, lastaddr);
+    }
+
+    return read_hexfile (filename, lastaddr);
+}
+
+/*****************************************************************************
+ *
+ *      Cache of decoded images
+ *
+ ****************************************************************************/
+
+/**
+ * Directory of the cache: $XDG_CACHE_HOME/fboot or ~/.cache/fboot,
+ * created if needed
+ *
+ * @return 0 on success
+ */
+static int cache_dir (char      *dir,
+                      size_t    len)
+{
+    const char  *base = getenv ("XDG_CACHE_HOME");
+    const char  *home = getenv ("HOME");
+
+    if (base && *base)
+        snprintf (dir, len, "%s", base);
+    else if (home && *home)
+        snprintf (dir, len, "%s/.cache", home);
+    else
+        return -1;
+
+    mkdir (dir, 0700);
+    strncat (dir, "/fboot", len - strlen (dir) - 1);
+    if ((mkdir (dir, 0700) < 0) && (errno != EEXIST))
+        return -1;
+
+    return 0;
+}
+
+
+/**
+ * 64 bit FNV-1a hash
+ */
+static uint64_t hash_fnv (uint64_t              hash,
+                          const unsigned char   *p,
+                          size_t                len)
+{
+    while (len--)
+    {
+        hash ^= *p++;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+#define FNV_INIT    0xCBF29CE484222325ULL
+
+
+/**
+ * Registers an image of the cache, so release_image knows how to free
+ * the data and image_program_crc finds the CRC
+ */
+static int cache_register (char             *data,
+                           void             *map,
+                           size_t           len,
+                           unsigned long    lastaddr,
+                           unsigned int     crc)
+{
+    int i;
+
+    for (i = 0; i < CACHE_MAPS; i++)
+    {
+        if (cache_maps[i].data == NULL)
+        {
+            cache_maps[i].data     = data;
+            cache_maps[i].map      = map;
+            cache_maps[i].len      = len;
+            cache_maps[i].lastaddr = lastaddr;
+            cache_maps[i].crc      = crc;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * Maps a valid cache entry
+ *
+ * @return data or NULL if there is no valid entry
+ */
+static char * cache_load (const char        *path,
+                          const cacheHeader_t *key,
+                          unsigned long     *lastaddr)
+{
+    const cacheHeader_t *head;
+    struct stat st;
+    void        *map;
+    char        *data;
+    int         fd;
+    int         ok;
+
+    if ((fd = open (path, O_RDONLY)) < 0)
+        return NULL;
+
+    if ((fstat (fd, &st) < 0) || (st.st_size < sizeof (cacheHeader_t)))
+    {
+        close (fd);
+        return NULL;
+    }
+
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    head = map;
+    data = (char *)map + sizeof (cacheHeader_t);
+
+    ok = (memcmp (head->magic, CACHE_MAGIC, 4) == 0) &&
+         (head->version   == CACHE_VERSION) &&
+         (head->size      == key->size) &&
+         (head->mtime     == key->mtime) &&
+         (head->mtime_ns  == key->mtime_ns) &&
+         (head->ctime     == key->ctime) &&
+         (head->ctime_ns  == key->ctime_ns) &&
+         (head->dev       == key->dev) &&
+         (head->ino       == key->ino) &&
+         (head->base      == key->base) &&
+         (head->lastaddr  <  MAXFLASH) &&
+         (st.st_size      == sizeof (cacheHeader_t) + head->lastaddr + 1);
+
+    // the entry itself might be damaged, the CRC is sent to the target
+    if (ok)
+        ok = (wire_program_crc ((const unsigned char *)data, head->lastaddr + 1) == head->crc);
+
+    if (!ok || (cache_register (data, map, st.st_size, head->lastaddr, head->crc) < 0))
+    {
+        munmap (map, st.st_size);
+        return NULL;
+    }
+
+    *lastaddr = head->lastaddr;
+    return data;
+}
+
+
+/**
+ * Writes a cache entry (to a temporary file, renamed when complete)
+ */
+static void cache_store (const char     *path,
+                         cacheHeader_t  *head,
+                         const char     *data,
+                         unsigned long  lastaddr)
+{
+    char    tmp[PATH_MAX + 16];
+    FILE    *fp;
+    int     ok;
+
+    head->lastaddr = lastaddr;
+    head->crc      = wire_program_crc ((const unsigned char *)data, lastaddr + 1);
+
+    snprintf (tmp, sizeof (tmp), "%s.%d", path, (int)getpid ());
+    if ((fp = fopen (tmp, "wb")) == NULL)
+        return;
+
+    ok = (fwrite (head, sizeof (*head), 1, fp) == 1) &&
+         (fwrite (data, 1, lastaddr + 1, fp) == lastaddr + 1);
+    ok = !fclose (fp) && ok;
+
+    if (!ok || (rename (tmp, path) < 0))
+        unlink (tmp);
+}
+
+
+/**
+ * Read an image, using the cache in $XDG_CACHE_HOME/fboot: the entry is
+ * found by the path (and load address) of the file and is valid as long
+ * as size, modification and change time (ns) and inode of the file
+ * match; the file itself is not read for a hit
+ */
+char * read_image_cached (const char    *filename,
+                          unsigned long base,
+                          unsigned long *lastaddr)
+{
+    cacheHeader_t   key;
+    struct stat     st;
+    char            real[PATH_MAX];
+    char            path[PATH_MAX];
+    char            dir[PATH_MAX - 40];
+    char            *data;
+
+    if (!use_cache || (realpath (filename, real) == NULL) ||
+        (cache_dir (dir, sizeof (dir)) < 0) ||
+        (stat (real, &st) < 0) || (st.st_size == 0))
+    {
+        return read_image (filename, base, lastaddr);
+    }
+
+    memset (&key, 0, sizeof (key));
+    memcpy (key.magic, CACHE_MAGIC, 4);
+    key.version  = CACHE_VERSION;
+    key.size     = st.st_size;
+    key.mtime    = st.st_mtim.tv_sec;
+    key.mtime_ns = st.st_mtim.tv_nsec;
+    key.ctime    = st.st_ctim.tv_sec;
+    key.ctime_ns = st.st_ctim.tv_nsec;
+    key.dev      = st.st_dev;
+    key.ino      = st.st_ino;
+    key.base     = base;
+
+    // name of the entry from path and load address
+    snprintf (path, sizeof (path), "%s/%016llx.img", dir,
+              (unsigned long long)hash_fnv (hash_fnv (FNV_INIT,
+                                                      (const unsigned char *)real,
+                                                      strlen (real)),
+                                            (const unsigned char *)&base,
+                                            sizeof (base)));
+
+    if ((data = cache_load (path, &key, lastaddr)) != NULL)
+    {
+        printf("Reading       : %s... File read (cached).\n", filename);
+        return data;
+    }
+
+    data = read_image (filename, base, lastaddr);
+    if (data != NULL)
+    {
+        cache_store (path, &key, data, *lastaddr);
+        cache_register (data, NULL, 0, *lastaddr, key.crc);
+    }
+
+    return data;
+}
+
+
+/**
+ * CRC of the PROGRAM transfer of an image of read_image_cached
+ */
+int image_program_crc (const char       *data,
+                       unsigned long    lastaddr,
+                       unsigned int     *crc)
+{
+    int i;
+
+    for (i = 0; i < CACHE_MAPS; i++)
+    {
+        if ((cache_maps[i].data == data) && (data != NULL) &&
+            (cache_maps[i].lastaddr == lastaddr))
+        {
+            *crc = cache_maps[i].crc;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * Switch the cache on or off
+ */
+void image_cache (int on)
+{
+    use_cache = on;
+}
+
+
+/**
+ * Frees an image of read_image / read_image_cached
+ */
+void release_image (char *data)
+{
+    int i;
+
+    if (data == NULL)
+        return;
+
+    for (i = 0; i < CACHE_MAPS; i++)
+    {
+        if (cache_maps[i].data == data)
+        {
+            if (cache_maps[i].map)
+                munmap (cache_maps[i].map, cache_maps[i].len);
+            else
+                free (data);
+            cache_maps[i].map  = NULL;
+            cache_maps[i].data = NULL;
+            return;
+        }
+    }
+    free (data);
+}
+
+/* end of file */
@@ -0,0 +1,80 @@
+/**
+ * Reading of flash images for the bootloader of Peter Dannegger
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+#ifndef IMAGE_H_INCLUDED
+#define IMAGE_H_INCLUDED
+
+
+/// Prototypes
+
+/**
+ * Reads an Intel HEX file into a flash buffer of MAXFLASH bytes,
+ * unused bytes are 0xFF
+ *
+ * @return buffer (to be freed) or NULL on error
+ */
+char * read_hexfile (const char     *filename,
+                     unsigned long  *lastaddr);
+
+/**
+ * Reads a raw binary file, loaded at address base
+ *
+ * @return buffer (to be freed) or NULL on error
+ */
+char * read_binfile (const char     *filename,
+                     unsigned long  base,
+                     unsigned long  *lastaddr);
+
+/**
+ * Reads the flash segments (.text, .data) of an AVR ELF file
+ *
+ * @return buffer (to be freed) or NULL on error
+ */
+char * read_elffile (const char     *filename,
+                     unsigned long  *lastaddr);
+
+/**
+ * Reads an ELF, raw binary (*.bin, at address base) or Intel HEX file
+ *
+ * @return buffer (to be freed) or NULL on error
+ */
+char * read_image (const char       *filename,
+                   unsigned long    base,
+                   unsigned long    *lastaddr);
+
+/**
+ * Reads an image like read_image, through the cache of decoded images
+ *
+ * @return buffer (to be released) or NULL on error
+ */
+char * read_image_cached (const char    *filename,
+                          unsigned long base,
+                          unsigned long *lastaddr);
+
+/**
+ * CRC of the PROGRAM transfer of an image of read_image_cached, as
+ * stored in the cache
+ *
+ * @return 0 if the CRC is known
+ */
+int image_program_crc (const char       *data,
+                       unsigned long    lastaddr,
+                       unsigned int     *crc);
+
+/**
+ * Switches the cache on or off
+ */
+void image_cache (int on);
+
+/**
+ * Releases an image of read_image or read_image_cached; the data
+ * of a cached image is read only
+ */
+void release_image (char *data);
+
+#endif //IMAGE_H_INCLUDED
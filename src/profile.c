@@ -0,0 +1,237 @@
+/**
+ * Transfer settings per serial adaptor for the bootloader of Peter Dannegger
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+
+/// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <glob.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "profile.h"
+
+
+#define BY_ID_DIR       "/dev/serial/by-id"
+#define PROFILE_LINE    (PATH_MAX + 128)
+
+static const char *mode_text[] = { "stream", "drain", "wait" };
+
+
+/**
+ * Name of the adaptor: its link in /dev/serial/by-id, if there is one,
+ * otherwise the device as given
+ */
+void profile_key (const char    *device,
+                  char          *key,
+                  size_t        len)
+{
+    char    real[PATH_MAX];
+    char    link[PATH_MAX];
+    glob_t  g;
+    size_t  i;
+
+    snprintf (key, len, "%s", device);
+
+    if (realpath (device, real) == NULL)
+        return;
+
+    if (glob (BY_ID_DIR "/*", 0, NULL, &g) != 0)
+        return;
+
+    for (i = 0; i < g.gl_pathc; i++)
+    {
+        if ((realpath (g.gl_pathv[i], link) != NULL) &&
+            (strcmp (link, real) == 0))
+        {
+            snprintf (key, len, "%s", g.gl_pathv[i] + strlen (BY_ID_DIR) + 1);
+            break;
+        }
+    }
+    globfree (&g);
+}
+
+
+/**
+ * Text of a transfer mode
+ */
+const char * profile_mode_text (profileMode_t mode)
+{
+    return mode_text[mode];
+}
+
+
+/**
+ * Path of the profile file, the directory is created
+ *
+ * @return 0 on success
+ */
+static int profile_path (char   *path,
+                         size_t len)
+{
+    const char  *base = getenv ("XDG_CONFIG_HOME");
+    const char  *home = getenv ("HOME");
+
+    if (base && *base)
+        snprintf (path, len, "%s", base);
+    else if (home && *home)
+        snprintf (path, len, "%s/.config", home);
+    else
+        return -1;
+
+    mkdir (path, 0700);
+    strncat (path, "/fboot", len - strlen (path) - 1);
+    if ((mkdir (path, 0700) < 0) && (errno != EEXIST))
+        return -1;
+    strncat (path, "/profiles", len - strlen (path) - 1);
+
+    return 0;
+}
+
+
+/**
+ * Parses one line of the profile file
+ *
+ * @return 0 if valid
+ */
+static int profile_parse (const char    *line,
+                          char          *key,
+                          unsigned long *baud,
+                          profile_t     *prof)
+{
+    char    mode[16];
+    int     i;
+
+    if (sscanf (line, "%4095s %lu %d %15s %d %lu",
+                key, baud, &prof->blocksize, mode, &prof->wait, &prof->rate) != 6)
+        return -1;
+
+    for (i = 0; i < sizeof (mode_text) / sizeof (mode_text[0]); i++)
+    {
+        if (strcmp (mode, mode_text[i]) == 0)
+        {
+            prof->mode = i;
+            return (prof->blocksize > 0) ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * Looks up the profile of an adaptor; an entry for another baudrate
+ * is used if there is none for this one
+ *
+ * @return 0 if found
+ */
+int profile_load (const char    *device,
+                  unsigned long baud,
+                  profile_t     *prof)
+{
+    char            path[PATH_MAX];
+    char            want[PATH_MAX];
+    char            line[PROFILE_LINE];
+    char            key[PATH_MAX];
+    unsigned long   b;
+    profile_t       p;
+    int             found = -1;
+    FILE            *fp;
+
+    if (profile_path (path, sizeof (path)) < 0)
+        return -1;
+    if ((fp = fopen (path, "r")) == NULL)
+        return -1;
+
+    profile_key (device, want, sizeof (want));
+
+    while (fgets (line, sizeof (line), fp))
+    {
+        if ((line[0] == '#') || (profile_parse (line, key, &b, &p) != 0) ||
+            (strcmp (key, want) != 0))
+            continue;
+
+        if ((b == baud) || (found < 0))
+        {
+            *prof = p;
+            found = 0;
+            if (b == baud)
+                break;
+        }
+    }
+    fclose (fp);
+
+    return found;
+}
+
+
+/**
+ * Stores (or replaces) the profile of an adaptor
+ *
+ * @return 0 on success
+ */
+int profile_store (const char       *device,
+                   unsigned long    baud,
+                   const profile_t  *prof)
+{
+    char            path[PATH_MAX];
+    char            tmp[PATH_MAX + 16];
+    char            want[PATH_MAX];
+    char            line[PROFILE_LINE];
+    char            key[PATH_MAX];
+    unsigned long   b;
+    profile_t       p;
+    FILE            *in;
+    FILE            *out;
+    int             ok;
+
+    if (profile_path (path, sizeof (path)) < 0)
+    {
+        printf ("No directory for the profiles ($XDG_CONFIG_HOME, $HOME)!\n");
+        return -1;
+    }
+
+    profile_key (device, want, sizeof (want));
+
+    snprintf (tmp, sizeof (tmp), "%s.%d", path, (int)getpid ());
+    if ((out = fopen (tmp, "w")) == NULL)
+    {
+        printf ("File \"%s\" open failed: %s!\n", tmp, strerror (errno));
+        return -1;
+    }
+
+    // keep the other entries
+    if ((in = fopen (path, "r")) != NULL)
+    {
+        while (fgets (line, sizeof (line), in))
+        {
+            if ((profile_parse (line, key, &b, &p) == 0) &&
+                (strcmp (key, want) == 0) && (b == baud))
+                continue;
+            fputs (line, out);
+        }
+        fclose (in);
+    }
+
+    fprintf (out, "%s %lu %d %s %d %lu\n", want, baud, prof->blocksize,
+             mode_text[prof->mode], prof->wait, prof->rate);
+
+    ok = !ferror (out);
+    ok = !fclose (out) && ok;
+    if (!ok || (rename (tmp, path) < 0))
+    {
+        printf ("Writing \"%s\" failed: %s!\n", path, strerror (errno));
+        unlink (tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* end of file */
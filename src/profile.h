@@ -0,0 +1,69 @@
+/**
+ * Transfer settings per serial adaptor for the bootloader of Peter Dannegger
+ *
+ * --autotune measures the best blocksize and drain mode of an adaptor;
+ * they are kept in $XDG_CONFIG_HOME/fboot/profiles, one line per
+ * adaptor and baudrate:
+ *
+ *   <name in /dev/serial/by-id> <baud> <blocksize> <stream|drain|wait> <n> <bytes/s>
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+#ifndef PROFILE_H_INCLUDED
+#define PROFILE_H_INCLUDED
+
+#include <stddef.h>
+
+
+// how blocks are finished
+typedef enum {
+    PROFILE_STREAM = 0,     // keep the output queue filled
+    PROFILE_DRAIN,          // tcdrain after every block (-D)
+    PROFILE_WAIT            // wait n byte times after every block (-w n)
+} profileMode_t;
+
+typedef struct
+{
+    int             blocksize;  // -t
+    profileMode_t   mode;
+    int             wait;       // byte times for PROFILE_WAIT
+    unsigned long   rate;       // measured bytes/s
+} profile_t;
+
+
+/// Prototypes
+
+/**
+ * Name of the adaptor: its link in /dev/serial/by-id, if there is one,
+ * otherwise the device as given
+ */
+void profile_key (const char *device, char *key, size_t len);
+
+/**
+ * Text of a transfer mode
+ */
+const char * profile_mode_text (profileMode_t mode);
+
+/**
+ * Looks up the profile of an adaptor; an entry for another baudrate
+ * is used if there is none for this one
+ *
+ * @return 0 if found
+ */
+int profile_load (const char        *device,
+                  unsigned long     baud,
+                  profile_t         *prof);
+
+/**
+ * Stores (or replaces) the profile of an adaptor
+ *
+ * @return 0 on success
+ */
+int profile_store (const char       *device,
+                   unsigned long    baud,
+                   const profile_t  *prof);
+
+#endif //PROFILE_H_INCLUDED
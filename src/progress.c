@@ -0,0 +1,254 @@
+/**
+ * Progress output for the bootloader of Peter Dannegger
+ *
+ * The transfer loops only store the position; a thread draws the bar
+ * ten times a second with one write(), so a slow terminal (ssh, a log
+ * pipe) can't hold up the serial stream. The width of the terminal is
+ * read once and again on SIGWINCH only. Without a terminal on stdout
+ * nothing is drawn.
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+
+/// Includes
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "progress.h"
+
+
+#define TRUE    1
+#define FALSE   0
+
+#define REDRAW_NS   100000000L  // 10 Hz
+#define MAX_COLUMNS 512
+
+
+/// Attributes
+
+static int                      show_progress = TRUE;
+static int                      tty = -1;           // stdout is a terminal, -1: unknown
+
+static const char               *bar_text;
+static atomic_ulong             bar_full;
+static atomic_ulong             bar_cur;
+
+static volatile sig_atomic_t    winch = TRUE;       // width has to be read
+static int                      columns = 80;
+
+static pthread_t                thread;
+static pthread_mutex_t          lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t           wake;
+static int                      running = FALSE;
+
+
+/**
+ * Switches the progress output on or off
+ */
+void progress_enable (int on)
+{
+    show_progress = on;
+}
+
+
+/**
+ * Checks if progress is shown, which needs a terminal on stdout
+ */
+int progress_enabled (void)
+{
+    if (tty < 0)
+        tty = isatty (STDOUT_FILENO);
+
+    return show_progress && tty;
+}
+
+
+/**
+ * The terminal has been resized
+ */
+static void sig_winch (int signal)
+{
+    winch = TRUE;
+}
+
+
+/**
+ * Draws the bar to fd with one write
+ */
+void progress_draw_to (int fd)
+{
+    char            line[MAX_COLUMNS + 16];
+    unsigned long   full = atomic_load_explicit (&bar_full, memory_order_relaxed);
+    unsigned long   cur  = atomic_load_explicit (&bar_cur, memory_order_relaxed);
+    int             cur100p;
+    int             cur_perc;
+    int             len;
+    int             n;
+
+    if (winch)
+    {
+        struct winsize win_size;
+
+        winch = FALSE;
+        if ((ioctl (STDOUT_FILENO, TIOCGWINSZ, &win_size) >= 0) && (win_size.ws_col > 0))
+            columns = (win_size.ws_col < MAX_COLUMNS) ? win_size.ws_col : MAX_COLUMNS;
+    }
+
+    if (full == 0)
+        return;
+    if (cur > full)
+        cur = full;
+
+    // the add. text is 2 * " [" "100%"
+    len = snprintf (line, MAX_COLUMNS, "%s [", bar_text ? bar_text : "");
+    cur100p = columns - len - 6;
+    if (cur100p < 0)
+        cur100p = 0;
+    cur_perc = ((unsigned long long)cur * cur100p) / full;
+
+    memset (line + len, '#', cur_perc);
+    memset (line + len + cur_perc, ' ', cur100p - cur_perc);
+    len += cur100p;
+    len += snprintf (line + len, sizeof (line) - len, "] %3d%%\r",
+                     (int)(((unsigned long long)cur * 100) / full));
+
+    for (n = 0; n < len; )
+    {
+        ssize_t w = write (fd, line + n, len - n);
+
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        n += w;
+    }
+}
+
+
+static void progress_draw (void)
+{
+    progress_draw_to (STDOUT_FILENO);
+}
+
+
+/**
+ * Redraws the bar until progress_done
+ */
+static void * progress_thread (void *arg)
+{
+    struct timespec next;
+    sigset_t        set;
+
+    // SIGWINCH is taken here only, the transfer is not interrupted
+    sigemptyset (&set);
+    sigaddset (&set, SIGWINCH);
+    pthread_sigmask (SIG_UNBLOCK, &set, NULL);
+
+    pthread_mutex_lock (&lock);
+    while (running)
+    {
+        progress_draw ();
+
+        clock_gettime (CLOCK_MONOTONIC, &next);
+        next.tv_nsec += REDRAW_NS;
+        if (next.tv_nsec >= 1000000000L)
+        {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        while (running && (pthread_cond_timedwait (&wake, &lock, &next) == 0));
+    }
+    pthread_mutex_unlock (&lock);
+
+    return NULL;
+}
+
+
+/**
+ * Starts showing the progress of full units with text
+ */
+void progress_start (const char     *text,
+                     unsigned long  full)
+{
+    static int          init = FALSE;
+    pthread_condattr_t  attr;
+    sigset_t            set;
+
+    bar_text = text;
+    atomic_store (&bar_full, full);
+    atomic_store (&bar_cur, 0);
+
+    if (!progress_enabled () || running)
+        return;
+
+    if (!init)
+    {
+        struct sigaction sa;
+
+        memset (&sa, 0, sizeof (sa));
+        sa.sa_handler = sig_winch;
+        sa.sa_flags   = SA_RESTART;
+        sigaction (SIGWINCH, &sa, NULL);
+
+        pthread_condattr_init (&attr);
+        pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+        pthread_cond_init (&wake, &attr);
+        pthread_condattr_destroy (&attr);
+        init = TRUE;
+    }
+
+    // the thread inherits the mask and unblocks SIGWINCH for itself
+    sigemptyset (&set);
+    sigaddset (&set, SIGWINCH);
+    pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+    fflush (stdout);
+    running = TRUE;
+    if (pthread_create (&thread, NULL, progress_thread, NULL) != 0)
+        running = FALSE;
+}
+
+
+/**
+ * Sets the current position
+ */
+void progress_update (unsigned long cur)
+{
+    atomic_store_explicit (&bar_cur, cur, memory_order_relaxed);
+}
+
+
+/**
+ * Stops showing the progress; if complete, the bar is drawn at 100%
+ */
+void progress_done (int complete)
+{
+    if (!running)
+        return;
+
+    pthread_mutex_lock (&lock);
+    running = FALSE;
+    pthread_cond_signal (&wake);
+    pthread_mutex_unlock (&lock);
+    pthread_join (thread, NULL);
+
+    if (complete)
+    {
+        atomic_store (&bar_cur, atomic_load (&bar_full));
+        progress_draw ();
+    }
+}
+
+/* end of file */
@@ -0,0 +1,50 @@
+/**
+ * Progress output for the bootloader of Peter Dannegger
+ *
+ * The bar is drawn by a thread at 10 Hz; the transfer loops only call
+ * progress_update, which is a single store.
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+#ifndef PROGRESS_H_INCLUDED
+#define PROGRESS_H_INCLUDED
+
+
+/// Prototypes
+
+/**
+ * Switches the progress output on or off
+ */
+void progress_enable (int on);
+
+/**
+ * Checks if progress is shown, which needs a terminal on stdout
+ */
+int progress_enabled (void);
+
+/**
+ * Starts showing the progress of full units with text
+ */
+void progress_start (const char     *text,
+                     unsigned long  full);
+
+/**
+ * Sets the current position
+ */
+void progress_update (unsigned long cur);
+
+/**
+ * Stops showing the progress; if complete, the bar is drawn at 100%
+ */
+void progress_done (int complete);
+
+/**
+ * Draws the bar of the current position once to fd, as the thread
+ * does (for the benchmarks)
+ */
+void progress_draw_to (int fd);
+
+#endif //PROGRESS_H_INCLUDED
@@ -0,0 +1,394 @@
+/**
+ * Timing report for the bootloader of Peter Dannegger
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+
+/// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "com.h"
+#include "report.h"
+
+
+/// Attributes
+
+static reportPhase_t        *phases = NULL;
+static int                  nphases = 0;
+static int                  maxphases = 0;
+static unsigned long        lostphases = 0;
+static reportPhase_t        *current = NULL;
+static unsigned long long   wire_start = 0;
+
+static reportLatency_t      *latency = NULL;
+static size_t               nlatency = 0;
+static size_t               maxlatency = 0;
+static unsigned long        slow_limit = 0;
+
+// buckets of the histogram: four per octave, up to 2^32 usec
+#define LAT_BUCKETS     128
+#define LAT_BAR         40
+
+
+typedef struct
+{
+    unsigned long   min;
+    unsigned long   median;
+    unsigned long   p99;
+    unsigned long   max;
+    unsigned long   count[LAT_BUCKETS];
+    int             first;      // first and last bucket in use
+    int             last;
+} latencyStats_t;
+
+
+/**
+ * Ends the running phase and starts a new one
+ */
+void report_phase (const char *name)
+{
+    report_end ();
+
+    if (nphases == maxphases)
+    {
+        int             n = maxphases ? 2 * maxphases : REPORT_PHASES;
+        reportPhase_t   *p = realloc (phases, n * sizeof (*phases));
+
+        if (p == NULL)
+        {
+            lostphases++;
+            return;
+        }
+        phases    = p;
+        maxphases = n;
+    }
+
+    current = &phases[nphases++];
+    memset (current, 0, sizeof (*current));
+    current->name  = name;
+    current->start = get_time_us ();
+    wire_start     = com_tx_count ();
+}
+
+
+/**
+ * Ends the running phase
+ */
+void report_end (void)
+{
+    if (current == NULL)
+        return;
+
+    current->time = get_time_us () - current->start;
+    current->wire = com_tx_count () - wire_start;
+    current = NULL;
+}
+
+
+/**
+ * Adds the data of a transfer to the running phase
+ */
+void report_data (unsigned long payload,
+                  unsigned long escapes,
+                  unsigned long blocks)
+{
+    if (current == NULL)
+        return;
+
+    current->payload += payload;
+    current->escapes += escapes;
+    current->blocks  += blocks;
+}
+
+
+/**
+ * Records the time from the last byte of a buffer to CONTINUE
+ */
+void report_latency (unsigned long      addr,
+                     unsigned long long time)
+{
+    if (nlatency == maxlatency)
+    {
+        size_t          n = maxlatency ? 2 * maxlatency : 256;
+        reportLatency_t *p = realloc (latency, n * sizeof (*latency));
+
+        if (p == NULL)
+            return;
+        latency    = p;
+        maxlatency = n;
+    }
+    latency[nlatency].addr = addr;
+    latency[nlatency].time = time;
+    nlatency++;
+}
+
+
+/**
+ * Forgets the recorded latencies
+ */
+void report_latency_clear (void)
+{
+    nlatency = 0;
+}
+
+
+/**
+ * Buffers answered slower than limit usec are listed, 0: none
+ */
+void report_latency_limit (unsigned long limit)
+{
+    slow_limit = limit;
+}
+
+
+/**
+ * Sorts latencies
+ */
+static int compare_time (const void *a, const void *b)
+{
+    unsigned long ta = *(const unsigned long *)a;
+    unsigned long tb = *(const unsigned long *)b;
+
+    return (ta > tb) - (ta < tb);
+}
+
+
+/**
+ * Histogram bucket of a latency: the octave [2^n, 2^(n+1)) usec is
+ * split in four buckets by the two bits below the leading one
+ */
+static int latency_bucket (unsigned long time)
+{
+    int n = 2;
+
+    if (time < 4)
+        return time;
+    if (time > 0xffffffffUL)
+        time = 0xffffffffUL;
+
+    while (time >> (n + 1))
+        n++;
+    return 4 * n + ((time >> (n - 2)) & 3);
+}
+
+/**
+ * Lower bound of a histogram bucket in usec
+ */
+static unsigned long latency_bucket_start (int bucket)
+{
+    if (bucket < 4)
+        return bucket;
+    return (4UL + (bucket & 3)) << (bucket / 4 - 2);
+}
+
+
+/**
+ * Calculates min / median / p99 / max (nearest rank) and the histogram
+ *
+ * @return 0 if there are no latencies
+ */
+static int latency_stats (latencyStats_t *st)
+{
+    unsigned long   *t;
+    size_t          i;
+
+    memset (st, 0, sizeof (*st));
+    if (nlatency == 0)
+        return 0;
+
+    if ((t = malloc (nlatency * sizeof (*t))) == NULL)
+        return 0;
+
+    st->first = LAT_BUCKETS;
+    for (i = 0; i < nlatency; i++)
+    {
+        int b = latency_bucket (latency[i].time);
+
+        t[i] = latency[i].time;
+        st->count[b]++;
+        if (b < st->first)
+            st->first = b;
+        if (b > st->last)
+            st->last = b;
+    }
+    qsort (t, nlatency, sizeof (*t), compare_time);
+
+    st->min    = t[0];
+    st->median = t[(nlatency + 1) / 2 - 1];
+    st->p99    = t[(nlatency * 99 + 99) / 100 - 1];
+    st->max    = t[nlatency - 1];
+    free (t);
+
+    return 1;
+}
+
+
+/**
+ * Prints statistics and histogram of the CONTINUE latencies
+ */
+void report_latency_print (void)
+{
+    latencyStats_t  st;
+    unsigned long   peak = 0;
+    size_t          i;
+    int             b;
+
+    if (!latency_stats (&st))
+        return;
+
+    printf("CONTINUE      : %lu buffers, min %.2f, median %.2f, p99 %.2f, max %.2f ms\n",
+           (unsigned long)nlatency, st.min / 1000.0, st.median / 1000.0,
+           st.p99 / 1000.0, st.max / 1000.0);
+
+    for (b = st.first; b <= st.last; b++)
+        if (st.count[b] > peak)
+            peak = st.count[b];
+
+    for (b = st.first; b <= st.last; b++)
+    {
+        int len = (st.count[b] * LAT_BAR + peak - 1) / peak;
+
+        if (st.count[b] == 0)
+            continue;
+        printf("  %9.3f ms %6lu |%.*s\n", latency_bucket_start (b) / 1000.0, st.count[b], len,
+               "########################################");
+    }
+
+    if (slow_limit == 0)
+        return;
+
+    for (i = 0; i < nlatency; i++)
+    {
+        if (latency[i].time > slow_limit)
+            printf("Slow buffer   : 0x%05lX  %.2f ms\n",
+                   latency[i].addr, latency[i].time / 1000.0);
+    }
+}
+
+
+/**
+ * Prints the phases
+ */
+void report_print (void)
+{
+    unsigned long long total = 0;
+    int i;
+
+    report_end ();
+
+    printf("Phase           time/ms    wire   payload  escapes  blocks\n");
+    for (i = 0; i < nphases; i++)
+    {
+        printf("%-12s %10.3f %7llu %9lu %8lu %7lu\n",
+               phases[i].name, phases[i].time / 1000.0, phases[i].wire,
+               phases[i].payload, phases[i].escapes, phases[i].blocks);
+        total += phases[i].time;
+    }
+    printf("%-12s %10.3f\n", "total", total / 1000.0);
+    if (lostphases)
+        printf("%lu phases not recorded, out of memory!\n", lostphases);
+}
+
+
+/**
+ * Writes a JSON string
+ */
+static void json_string (FILE *fp, const char *s)
+{
+    fputc ('"', fp);
+    for (; s && *s; s++)
+    {
+        if ((*s == '"') || (*s == '\\'))
+            fprintf (fp, "\\%c", *s);
+        else if ((unsigned char)*s < ' ')
+            fprintf (fp, "\\u%04x", (unsigned char)*s);
+        else
+            fputc (*s, fp);
+    }
+    fputc ('"', fp);
+}
+
+
+/**
+ * Writes the report as JSON
+ *
+ * @return 0 on success
+ */
+int report_write (const char    *filename,
+                  const char    *device,
+                  unsigned long baud,
+                  const char    *image,
+                  int           result,
+                  const char    *result_text)
+{
+    unsigned long long total = 0;
+    latencyStats_t  lat;
+    FILE    *fp;
+    int     i;
+
+    report_end ();
+
+    if ((fp = fopen (filename, "w")) == NULL)
+    {
+        printf ("Report \"%s\" open failed: %s!\n", filename, strerror (errno));
+        return -1;
+    }
+
+    fprintf (fp, "{\n  \"device\": ");
+    json_string (fp, device);
+    fprintf (fp, ",\n  \"baud\": %lu,\n  \"image\": ", baud);
+    json_string (fp, image);
+    fprintf (fp, ",\n  \"result\": %d,\n  \"result_text\": ", result);
+    json_string (fp, result_text);
+    fprintf (fp, ",\n  \"phases\": [\n");
+
+    for (i = 0; i < nphases; i++)
+    {
+        fprintf (fp, "    { \"name\": ");
+        json_string (fp, phases[i].name);
+        fprintf (fp, ", \"start_us\": %llu, \"time_us\": %llu, \"wire_bytes\": %llu,"
+                     " \"payload_bytes\": %lu, \"escapes\": %lu, \"blocks\": %lu }%s\n",
+                 phases[i].start - phases[0].start, phases[i].time, phases[i].wire,
+                 phases[i].payload, phases[i].escapes, phases[i].blocks,
+                 (i < nphases - 1) ? "," : "");
+        total += phases[i].time;
+    }
+    fprintf (fp, "  ],\n  \"total_us\": %llu", total);
+    if (lostphases)
+        fprintf (fp, ",\n  \"phases_dropped\": %lu", lostphases);
+
+    if (latency_stats (&lat))
+    {
+        size_t  j;
+        int     b;
+
+        fprintf (fp, ",\n  \"continue_latency\": {\n"
+                     "    \"blocks\": %lu, \"min_us\": %lu, \"median_us\": %lu,"
+                     " \"p99_us\": %lu, \"max_us\": %lu,\n    \"histogram\": [",
+                 (unsigned long)nlatency, lat.min, lat.median, lat.p99, lat.max);
+        for (b = lat.first; b <= lat.last; b++)
+            fprintf (fp, "%s{ \"from_us\": %lu, \"count\": %lu }",
+                     (b > lat.first) ? ", " : "", latency_bucket_start (b), lat.count[b]);
+        fprintf (fp, "],\n    \"blocks_us\": [");
+        for (j = 0; j < nlatency; j++)
+            fprintf (fp, "%s{ \"addr\": %lu, \"us\": %lu }",
+                     j ? ", " : "", latency[j].addr, latency[j].time);
+        fprintf (fp, "]\n  }");
+    }
+    fprintf (fp, "\n}\n");
+
+    if (fclose (fp) != 0)
+    {
+        printf ("Writing report \"%s\" failed: %s!\n", filename, strerror (errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* end of file */
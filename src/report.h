@@ -0,0 +1,97 @@
+/**
+ * Timing report for the bootloader of Peter Dannegger
+ *
+ * The work is split into phases (loading the file, opening the port,
+ * connecting, each query, programming, ...); for every phase the time
+ * and the bytes on the wire are recorded. The report is printed and
+ * written as JSON.
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+#ifndef REPORT_H_INCLUDED
+#define REPORT_H_INCLUDED
+
+
+// initial number of recorded phases, the list grows as needed
+#define REPORT_PHASES   64
+
+typedef struct
+{
+    const char          *name;
+    unsigned long long  start;      // usec, monotonic
+    unsigned long long  time;       // usec
+    unsigned long long  wire;       // bytes written to the device
+    unsigned long       payload;    // data bytes of the image
+    unsigned long       escapes;    // escaped data bytes
+    unsigned long       blocks;     // buffers answered with CONTINUE
+} reportPhase_t;
+
+// answer time of one buffer
+typedef struct
+{
+    unsigned long       addr;       // flash address of the buffer
+    unsigned long       time;       // usec from its last byte to CONTINUE
+} reportLatency_t;
+
+
+/// Prototypes
+
+/**
+ * Ends the running phase and starts a new one
+ */
+void report_phase (const char *name);
+
+/**
+ * Ends the running phase
+ */
+void report_end (void);
+
+/**
+ * Adds the data of a transfer to the running phase
+ */
+void report_data (unsigned long payload,
+                  unsigned long escapes,
+                  unsigned long blocks);
+
+/**
+ * Records the time from the last byte of a buffer to CONTINUE
+ */
+void report_latency (unsigned long      addr,
+                     unsigned long long time);
+
+/**
+ * Forgets the recorded latencies
+ */
+void report_latency_clear (void);
+
+/**
+ * Buffers answered slower than limit usec are listed, 0: none
+ */
+void report_latency_limit (unsigned long limit);
+
+/**
+ * Prints statistics and histogram of the CONTINUE latencies
+ */
+void report_latency_print (void);
+
+/**
+ * Prints the phases
+ */
+void report_print (void);
+
+/**
+ * Writes the report as JSON
+ *
+ * @return 0 on success
+ */
+int report_write (const char    *filename,
+                  const char    *device,
+                  unsigned long baud,
+                  const char    *image,
+                  int           result,
+                  const char    *result_text);
+
+#endif //REPORT_H_INCLUDED
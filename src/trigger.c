@@ -0,0 +1,328 @@
+/**
+ * Pattern triggers of the terminal mode for the bootloader of Peter Dannegger
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+
+/// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trigger.h"
+
+
+static const char *action_names[] = { "program", "verify", "send", "reset", "mark" };
+
+
+/// Attributes
+
+static trigger_t        *triggers = NULL;
+static int              ntriggers = 0;
+static int              *same = NULL;       // next trigger with the same pattern
+
+// automaton: state * 256 + byte -> state, 0 is the root
+static int              *delta = NULL;
+static unsigned char    *hit = NULL;        // a pattern ends in the state or its suffixes
+static int              *out = NULL;        // first trigger ending in the state, -1: none
+static int              *dict = NULL;       // next suffix state with a trigger, -1: none
+static int              state = 0;
+
+static int              queue[TRIGGER_QUEUE];
+static unsigned int     q_head = 0;
+static unsigned int     q_tail = 0;
+
+
+/**
+ * Decodes \r \n \t \e \\ and \xNN
+ *
+ * @return buffer (to be freed) or NULL on error, len is set
+ */
+static char * unescape (const char  *text,
+                        size_t      *len)
+{
+    char    *buf = malloc (strlen (text) + 1);
+    char    *p = buf;
+    char    *end;
+
+    if (buf == NULL)
+        return NULL;
+
+    while (*text)
+    {
+        if (*text != '\\')
+        {
+            *p++ = *text++;
+            continue;
+        }
+
+        text++;
+        switch (*text)
+        {
+            case 'r':  *p++ = '\r'; text++; break;
+            case 'n':  *p++ = '\n'; text++; break;
+            case 't':  *p++ = '\t'; text++; break;
+            case 'e':  *p++ = 27;   text++; break;
+            case '\\': *p++ = '\\'; text++; break;
+            case 'x':
+                *p++ = (char) strtoul (text + 1, &end, 16);
+                if ((end == text + 1) || (end > text + 3))
+                {
+                    free (buf);
+                    return NULL;
+                }
+                text = end;
+                break;
+            default:
+                free (buf);
+                return NULL;
+        }
+    }
+    *len = p - buf;
+    return buf;
+}
+
+
+/**
+ * Adds a trigger
+ */
+int trigger_add (const char     *pattern,
+                 const char     *action)
+{
+    const char  *eq = strchr (action, '=');
+    size_t      nlen = eq ? (size_t)(eq - action) : strlen (action);
+    trigger_t   *t;
+    trigger_t   *tmp;
+    int         a;
+
+    for (a = TRIGGER_PROGRAM; a <= TRIGGER_MARK; a++)
+        if ((strlen (action_names[a]) == nlen) && (strncmp (action, action_names[a], nlen) == 0))
+            break;
+
+    if (a > TRIGGER_MARK)
+    {
+        printf ("Unknown trigger action \"%s\"!\n", action);
+        return -1;
+    }
+    if (((a == TRIGGER_SEND) && !eq) || ((a == TRIGGER_RESET) && eq))
+    {
+        printf ("Trigger action \"%s\" not possible!\n", action);
+        return -1;
+    }
+
+    if ((tmp = realloc (triggers, (ntriggers + 1) * sizeof (trigger_t))) == NULL)
+    {
+        printf ("Memory allocation error!\n");
+        return -1;
+    }
+    triggers = tmp;
+    t = &triggers[ntriggers];
+    memset (t, 0, sizeof (*t));
+
+    t->spec   = pattern;
+    t->action = a;
+
+    t->pattern = unescape (pattern, &t->plen);
+    if ((t->pattern == NULL) || (t->plen == 0))
+    {
+        printf ("Trigger pattern \"%s\" not possible!\n", pattern);
+        free (t->pattern);
+        return -1;
+    }
+
+    if (eq)
+    {
+        // files are taken as they are
+        if ((a == TRIGGER_PROGRAM) || (a == TRIGGER_VERIFY))
+        {
+            t->arg  = strdup (eq + 1);
+            t->alen = strlen (eq + 1);
+        }
+        else
+            t->arg = unescape (eq + 1, &t->alen);
+
+        if (t->arg == NULL)
+        {
+            printf ("Trigger action \"%s\" not possible!\n", action);
+            free (t->pattern);
+            return -1;
+        }
+    }
+
+    ntriggers++;
+    return 0;
+}
+
+
+/**
+ * Number of triggers added
+ */
+int trigger_count (void)
+{
+    return ntriggers;
+}
+
+
+/**
+ * Builds the automaton: the trie of the patterns, then the failure
+ * links breadth first, which complete the table
+ */
+int trigger_build (void)
+{
+    size_t  nstates = 1;
+    int     *fail;
+    int     *bfs;
+    int     used = 1;
+    int     head = 0;
+    int     i, c;
+
+    for (i = 0; i < ntriggers; i++)
+        nstates += triggers[i].plen;
+
+    delta = malloc (nstates * 256 * sizeof (int));
+    hit   = calloc (nstates, 1);
+    out   = malloc (nstates * sizeof (int));
+    dict  = malloc (nstates * sizeof (int));
+    same  = malloc (ntriggers * sizeof (int));
+    fail  = malloc (nstates * sizeof (int));
+    bfs   = malloc (nstates * sizeof (int));
+    if (!delta || !hit || !out || !dict || !same || !fail || !bfs)
+    {
+        printf ("Memory allocation error, could not build the triggers!\n");
+        free (fail);
+        free (bfs);
+        return -1;
+    }
+
+    memset (delta, -1, nstates * 256 * sizeof (int));
+    memset (out, -1, nstates * sizeof (int));
+    memset (dict, -1, nstates * sizeof (int));
+
+    // the trie
+    for (i = 0; i < ntriggers; i++)
+    {
+        int s = 0;
+        size_t k;
+
+        for (k = 0; k < triggers[i].plen; k++)
+        {
+            int *next = &delta[s * 256 + (unsigned char)triggers[i].pattern[k]];
+
+            if (*next < 0)
+                *next = used++;
+            s = *next;
+        }
+        same[i] = out[s];
+        out[s]  = i;
+    }
+
+    // the failure links; the row of a state still holds its children
+    // only when it is taken from the queue
+    fail[0] = 0;
+    bfs[0]  = 0;
+    used    = 1;
+    while (head < used)
+    {
+        int s = bfs[head++];
+
+        for (c = 0; c < 256; c++)
+        {
+            int next = delta[s * 256 + c];
+
+            if (next > 0)
+            {
+                // the row of the shallower fail[s] is complete already
+                fail[next] = (s == 0) ? 0 : delta[fail[s] * 256 + c];
+
+                dict[next] = (out[fail[next]] >= 0) ? fail[next] : dict[fail[next]];
+                hit[next]  = (out[next] >= 0) || (dict[next] >= 0);
+                bfs[used++] = next;
+            }
+            else
+                delta[s * 256 + c] = (s == 0) ? 0 : delta[fail[s] * 256 + c];
+        }
+    }
+
+    free (fail);
+    free (bfs);
+
+    state = 0;
+    return 0;
+}
+
+
+/**
+ * Queues the triggers of a state with a match
+ */
+static void trigger_hit (int s)
+{
+    int i;
+
+    for ( ; s >= 0; s = dict[s])
+    {
+        for (i = out[s]; i >= 0; i = same[i])
+        {
+            triggers[i].fired++;
+            if (q_head - q_tail < TRIGGER_QUEUE)
+                queue[q_head++ % TRIGGER_QUEUE] = i;
+        }
+    }
+}
+
+
+/**
+ * Scans received data
+ */
+void trigger_scan (const char   *buf,
+                   size_t       len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    const unsigned char *end = p + len;
+    int                 s = state;
+
+    if (delta == NULL)
+        return;
+
+    while (p < end)
+    {
+        s = delta[s * 256 + *p++];
+        if (hit[s])
+            trigger_hit (s);
+    }
+    state = s;
+}
+
+
+/**
+ * Takes the next queued action
+ */
+const trigger_t * trigger_next (void)
+{
+    if (q_tail == q_head)
+        return NULL;
+
+    return &triggers[queue[q_tail++ % TRIGGER_QUEUE]];
+}
+
+
+/**
+ * Forgets a partial match
+ */
+void trigger_restart (void)
+{
+    state = 0;
+}
+
+
+/**
+ * Name of an action
+ */
+const char * trigger_action_name (trigger_action_t action)
+{
+    return action_names[action];
+}
+
+/* end of file */
@@ -0,0 +1,94 @@
+/**
+ * Pattern triggers of the terminal mode for the bootloader of Peter Dannegger
+ *
+ * The received data is scanned for all patterns at once with an
+ * Aho-Corasick automaton, built into a full transition table: one table
+ * lookup per byte, whatever the number of patterns, and matches across
+ * the reads are found as well. A match only queues its action; the
+ * actions are taken after the data has been shown.
+ *
+ * Actions:  program[=file]  verify[=file]  send=text  reset  mark[=text]
+ *
+ * Patterns and texts may contain \r \n \t \e \\ and \xNN.
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+#ifndef TRIGGER_H_INCLUDED
+#define TRIGGER_H_INCLUDED
+
+#include <stddef.h>
+
+
+// actions queued between two trigger_next, more are dropped
+#define TRIGGER_QUEUE   16
+
+typedef enum
+{
+    TRIGGER_PROGRAM = 0,
+    TRIGGER_VERIFY,
+    TRIGGER_SEND,
+    TRIGGER_RESET,
+    TRIGGER_MARK
+} trigger_action_t;
+
+typedef struct
+{
+    const char          *spec;      // pattern as given
+    char                *pattern;
+    size_t              plen;
+    trigger_action_t    action;
+    char                *arg;       // file or text, NULL if none given
+    size_t              alen;
+    unsigned long       fired;
+} trigger_t;
+
+
+/// Prototypes
+
+/**
+ * Adds a trigger: action (see above) is taken when pattern is received
+ *
+ * @return 0 on success
+ */
+int trigger_add (const char     *pattern,
+                 const char     *action);
+
+/**
+ * Number of triggers added
+ */
+int trigger_count (void);
+
+/**
+ * Builds the automaton of the triggers added
+ *
+ * @return 0 on success
+ */
+int trigger_build (void);
+
+/**
+ * Scans received data, the matches are queued
+ */
+void trigger_scan (const char   *buf,
+                   size_t       len);
+
+/**
+ * Takes the next queued action
+ *
+ * @return the trigger or NULL if none is queued
+ */
+const trigger_t * trigger_next (void);
+
+/**
+ * Forgets a partial match, e.g. after the device has been reset
+ */
+void trigger_restart (void);
+
+/**
+ * Name of an action
+ */
+const char * trigger_action_name (trigger_action_t action);
+
+#endif //TRIGGER_H_INCLUDED
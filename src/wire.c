@@ -0,0 +1,354 @@
+/**
+ * Precompiled wire images ("bundles") for the bootloader of Peter Dannegger
+ *
+ * File layout (all numbers little endian, 32 bit):
+ *
+ *   0  "FBW1"
+ *   4  version
+ *   8  signature
+ *  12  minimum flash size
+ *  16  buffer size
+ *  20  last address
+ *  24  CRC-16 of the transfer: COMMAND, PROGRAM, stream, ESCAPE, ESC_SHIFT
+ *  28  number of full buffers (n)
+ *  32  length of the stream
+ *  36  CRC-16 of the transfer with VERIFY instead of PROGRAM
+ *  40  CRC-16 of the file: bytes 0 - 39, the offsets and the stream
+ *  44  reserved
+ *  48  n offsets: end of each full buffer in the stream
+ *  ..  escaped stream
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+
+/// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "com.h"
+#include "wire.h"
+#include "protocol.h"
+
+
+/**
+ * Read / write a 32 bit little endian value
+ */
+static unsigned long get_le32 (const uint8_t *p)
+{
+    return (unsigned long)p[0]         | ((unsigned long)p[1] << 8) |
+           ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static void put_le32 (uint8_t       *p,
+                      unsigned long v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/**
+ * CRC of the PROGRAM or VERIFY transfer of a stream, as calc_crc
+ * calculates it while sending
+ */
+static unsigned int wire_stream_crc (unsigned char  command,
+                                     const uint8_t  *stream,
+                                     size_t         len)
+{
+    const unsigned char cmd[2] = { COMMAND, command };
+    static const unsigned char end[2] = { ESCAPE, ESC_SHIFT };
+    unsigned int saved_crc = crc;
+    unsigned int ret;
+
+    crc = 0;
+    calc_crc_buf (cmd, 2);
+    calc_crc_buf (stream, len);
+    calc_crc_buf (end, 2);
+    ret = crc;
+    crc = saved_crc;
+
+    return ret;
+}
+
+/**
+ * CRC of the file: the header up to this CRC, the offsets and the stream
+ */
+static unsigned int wire_file_crc (const uint8_t    *file,
+                                   size_t           len)
+{
+    unsigned int saved_crc = crc;
+    unsigned int ret;
+
+    crc = 0;
+    calc_crc_buf (file, 40);
+    calc_crc_buf (file + WIRE_HEADER, len - WIRE_HEADER);
+    ret = crc;
+    crc = saved_crc;
+
+    return ret;
+}
+
+/**
+ * Escapes data for the PROGRAM / VERIFY stream
+ *
+ * @return number of bytes written to out (at most 2 * len)
+ */
+size_t wire_escape (const unsigned char *data,
+                    size_t              len,
+                    unsigned char       *out)
+{
+    unsigned char *o = out;
+    unsigned char d;
+
+    while (len--)
+    {
+        d = *data++;
+        if ((d == ESCAPE) || (d == 0x13))
+        {
+            *o++ = ESCAPE;
+            d += ESC_SHIFT;
+        }
+        *o++ = d;
+    }
+    return o - out;
+}
+
+
+/**
+ * Checks if a file is a bundle
+ */
+int wire_is_bundle (const char *filename)
+{
+    char    magic[4];
+    int     ret = 0;
+    FILE    *fp;
+
+    if ((fp = fopen (filename, "rb")) != NULL)
+    {
+        ret = (fread (magic, 1, 4, fp) == 4) &&
+              (memcmp (magic, WIRE_MAGIC, 4) == 0);
+        fclose (fp);
+    }
+    return ret;
+}
+
+
+/**
+ * CRC of the PROGRAM transfer of an image, escaped in pieces
+ */
+unsigned int wire_program_crc (const unsigned char  *data,
+                               size_t               len)
+{
+    static const unsigned char cmd[2] = { COMMAND, PROGRAM };
+    static const unsigned char end[2] = { ESCAPE, ESC_SHIFT };
+    unsigned char   buf[2 * WIRE_CHUNK];
+    unsigned int    saved_crc = crc;
+    unsigned int    ret;
+    size_t          n;
+
+    crc = 0;
+    calc_crc_buf (cmd, 2);
+    for ( ; len > 0; data += n, len -= n)
+    {
+        n = (len < sizeof (buf) / 2) ? len : sizeof (buf) / 2;
+        calc_crc_buf (buf, wire_escape (data, n, buf));
+    }
+    calc_crc_buf (end, 2);
+    ret = crc;
+    crc = saved_crc;
+
+    return ret;
+}
+
+
+/**
+ * Writes the bundle of an image
+ *
+ * @return 0 on success
+ */
+int wire_create (const char     *filename,
+                 const char     *data,
+                 unsigned long  lastaddr,
+                 unsigned long  signature,
+                 unsigned long  buffsize)
+{
+    unsigned long   size = lastaddr + 1;
+    unsigned long   nblocks = size / buffsize;
+    unsigned long   i;
+    size_t          headlen = WIRE_HEADER + 4 * nblocks;
+    size_t          len = 0;
+    uint8_t         *buf;
+    FILE            *fp;
+    int             ret = 0;
+
+    // worst case: every byte escaped
+    buf = malloc (headlen + 2 * size);
+    if (buf == NULL)
+    {
+        printf ("Memory allocation error, could not get %lu bytes for bundle!\n",
+                (unsigned long)(headlen + 2 * size));
+        return -1;
+    }
+    memset (buf, 0, headlen);
+
+    for (i = 0; i < size; i += buffsize)
+    {
+        unsigned long n = (size - i < buffsize) ? size - i : buffsize;
+
+        len += wire_escape ((const unsigned char *)data + i, n, buf + headlen + len);
+        if (n == buffsize)
+            put_le32 (buf + WIRE_HEADER + 4 * (i / buffsize), len);
+    }
+
+    memcpy (buf, WIRE_MAGIC, 4);
+    put_le32 (buf +  4, WIRE_VERSION);
+    put_le32 (buf +  8, signature);
+    put_le32 (buf + 12, size);
+    put_le32 (buf + 16, buffsize);
+    put_le32 (buf + 20, lastaddr);
+    put_le32 (buf + 24, wire_stream_crc (PROGRAM, buf + headlen, len));
+    put_le32 (buf + 28, nblocks);
+    put_le32 (buf + 32, len);
+    put_le32 (buf + 36, wire_stream_crc (VERIFY, buf + headlen, len));
+    put_le32 (buf + 40, wire_file_crc (buf, headlen + len));
+
+    if ((fp = fopen (filename, "wb")) == NULL)
+    {
+        printf ("File \"%s\" open failed: %s!\n", filename, strerror (errno));
+        free (buf);
+        return -1;
+    }
+    if ((fwrite (buf, 1, headlen + len, fp) != headlen + len) | fclose (fp))
+    {
+        printf ("Writing \"%s\" failed: %s!\n", filename, strerror (errno));
+        ret = -1;
+    }
+    free (buf);
+
+    return ret;
+}
+
+
+/**
+ * Maps a bundle
+ *
+ * @return 0 on success
+ */
+int wire_open (const char *filename,
+               wire_t     *wire)
+{
+    struct stat st;
+    const uint8_t *p;
+    unsigned long i;
+    unsigned long pos = 0;
+    unsigned long end;
+    int     fd;
+
+    memset (wire, 0, sizeof (*wire));
+
+    if ((fd = open (filename, O_RDONLY)) < 0)
+    {
+        printf ("File \"%s\" open failed: %s!\n", filename, strerror (errno));
+        return -1;
+    }
+    if ((fstat (fd, &st) < 0) || (st.st_size < WIRE_HEADER))
+    {
+        printf ("File \"%s\" is no bundle!\n", filename);
+        close (fd);
+        return -1;
+    }
+
+    wire->maplen = st.st_size;
+    wire->map = mmap (NULL, wire->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (wire->map == MAP_FAILED)
+    {
+        printf ("Mapping \"%s\" failed: %s!\n", filename, strerror (errno));
+        wire->map = NULL;
+        return -1;
+    }
+    p = wire->map;
+
+    if ((memcmp (p, WIRE_MAGIC, 4) != 0) || (get_le32 (p + 4) != WIRE_VERSION))
+    {
+        printf ("File \"%s\" is no bundle (or of an unknown version)!\n", filename);
+        wire_close (wire);
+        return -1;
+    }
+
+    wire->signature = get_le32 (p +  8);
+    wire->flashsize = get_le32 (p + 12);
+    wire->buffsize  = get_le32 (p + 16);
+    wire->lastaddr  = get_le32 (p + 20);
+    wire->crc       = get_le32 (p + 24);
+    wire->nblocks   = get_le32 (p + 28);
+    wire->streamlen = get_le32 (p + 32);
+    wire->verify_crc = get_le32 (p + 36);
+    wire->blockend  = p + WIRE_HEADER;
+    wire->stream    = wire->blockend + 4 * wire->nblocks;
+
+    if ((wire->buffsize == 0) || (wire->lastaddr >= MAXFLASH) ||
+        (wire->nblocks > wire->flashsize / wire->buffsize) ||
+        (WIRE_HEADER + 4 * wire->nblocks + wire->streamlen != wire->maplen))
+    {
+        printf ("Bundle \"%s\" is corrupt!\n", filename);
+        wire_close (wire);
+        return -1;
+    }
+
+    // don't send a damaged file to the target
+    if (wire_file_crc (p, wire->maplen) != get_le32 (p + 40))
+    {
+        printf ("Bundle \"%s\" is corrupt (CRC)!\n", filename);
+        wire_close (wire);
+        return -1;
+    }
+
+    // the buffers are sent from one end to the next
+    for (i = 0; i < wire->nblocks; i++)
+    {
+        end = wire_blockend (wire, i);
+        if ((end <= pos) || (end > wire->streamlen))
+        {
+            printf ("Bundle \"%s\" is corrupt (buffer %lu)!\n", filename, i);
+            wire_close (wire);
+            return -1;
+        }
+        pos = end;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Stream offset after full buffer i
+ */
+unsigned long wire_blockend (const wire_t  *wire,
+                             unsigned long i)
+{
+    return get_le32 (wire->blockend + 4 * i);
+}
+
+
+/**
+ * Unmaps a bundle
+ */
+void wire_close (wire_t *wire)
+{
+    if (wire->map)
+        munmap (wire->map, wire->maplen);
+    wire->map = NULL;
+}
+
+/* end of file */
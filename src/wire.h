@@ -0,0 +1,97 @@
+/**
+ * Precompiled wire images ("bundles") for the bootloader of Peter Dannegger
+ *
+ * A bundle holds the escaped PROGRAM data stream of an image, already
+ * split at the buffer size of the bootloader, so it can be mapped and
+ * sent without preparing the data again for every device.
+ *
+ * License: GPL
+ *
+ * @author Bernhard Michler
+ */
+
+#ifndef WIRE_H_INCLUDED
+#define WIRE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WIRE_MAGIC      "FBW1"
+#define WIRE_VERSION    3
+
+// size of the file header, all values little endian 32 bit
+#define WIRE_HEADER     48
+
+// data bytes escaped and sent at once by programflash / verifyflash
+#define WIRE_CHUNK      256
+
+typedef struct
+{
+    unsigned long   signature;  // required target signature
+    unsigned long   flashsize;  // minimum user flash of the target
+    unsigned long   buffsize;   // buffer size the stream is split for
+    unsigned long   lastaddr;   // last address of the image
+    unsigned int    crc;        // CRC of the PROGRAM transfer: command, stream, end marker
+    unsigned long   nblocks;    // number of full buffers (answered with CONTINUE)
+    unsigned long   streamlen;  // length of the escaped stream
+    unsigned int    verify_crc; // CRC of the VERIFY transfer
+
+    const uint8_t   *blockend;  // stream offset after each full buffer (le32)
+    const uint8_t   *stream;    // escaped data stream
+
+    void            *map;       // mapped file
+    size_t          maplen;
+} wire_t;
+
+/// Prototypes
+
+/**
+ * Escapes data for the PROGRAM / VERIFY stream
+ *
+ * @return number of bytes written to out (at most 2 * len)
+ */
+size_t wire_escape (const unsigned char *data,
+                    size_t              len,
+                    unsigned char       *out);
+
+/**
+ * CRC of the PROGRAM transfer of an image (command, escaped data, end
+ * marker), starting from 0 as after a CHECK_CRC
+ */
+unsigned int wire_program_crc (const unsigned char  *data,
+                               size_t               len);
+
+/**
+ * Checks if a file is a bundle
+ */
+int wire_is_bundle (const char *filename);
+
+/**
+ * Writes the bundle of an image
+ *
+ * @return 0 on success
+ */
+int wire_create (const char     *filename,
+                 const char     *data,
+                 unsigned long  lastaddr,
+                 unsigned long  signature,
+                 unsigned long  buffsize);
+
+/**
+ * Maps a bundle
+ *
+ * @return 0 on success
+ */
+int wire_open (const char *filename, wire_t *wire);
+
+/**
+ * Stream offset after full buffer i
+ */
+unsigned long wire_blockend (const wire_t *wire, unsigned long i);
+
+/**
+ * Unmaps a bundle
+ */
+void wire_close (wire_t *wire);
+
+#endif //WIRE_H_INCLUDED